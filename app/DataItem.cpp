@@ -1,31 +1,23 @@
 #include "DataItem.h"
 
+std::unordered_map<uint64_t, std::vector<vec3>> DataItem::split_layouts;
 float Particle::scale = 0.01;
 float Particle::shell_scale = 0.03;
 
 DataItem::DataItem(Renderer &renderer, DIProperties props, const ModelIndices &indices) : props(props), renderer(renderer) {
-    uint32_t instance_id = 0;
     is_static = false;
-    transform = nvmath::translation_mat4(nvmath::vec3f(props.position.x, props.position.y + 0.5, props.position.z)) * 
+    mat4 transform = nvmath::translation_mat4(nvmath::vec3f(props.position.x, props.position.y + 0.5, props.position.z)) * 
                     nvmath::scale_mat4(nvmath::vec3f(1, 1, 1));
+    idx = renderer.m_instances.size();
     renderer.m_instances.push_back({transform, indices.cube_pos_idx, 0});
-    idx_pos = renderer.m_instances.size() - 1;
     renderer.m_instances.push_back({transform, indices.cube_neg_idx, 0});
-    idx_neg = renderer.m_instances.size() - 1;
-    idx_ref = -1;
-    idx_pos_constr = -1;
-    idx_neg_constr = -1;
     if (props.is_construction) {
         renderer.m_instances.push_back({transform, indices.cube_pos_prt_idx, 0});
-        idx_pos_constr = renderer.m_instances.size() - 1;
         renderer.m_instances.push_back({transform, indices.cube_neg_prt_idx, 0});
-        idx_neg_constr = renderer.m_instances.size() - 1;
     }
     if (props.is_has_reference) {
         renderer.m_instances.push_back({nvmath::translation_mat4(nvmath::vec3f(props.position.x, props.position.y + 0.4, props.position.z)) * 
                         nvmath::scale_mat4(nvmath::vec3f(1.0f, 0.8f, 1.0f)), indices.glass_idx, 0});
-
-        idx_ref = renderer.m_instances.size() - 1;
     }
 }
 
@@ -42,11 +34,16 @@ void DataItem::moveTo(vec3 position, bool is_hidden) {
     mat4 transform_pos;
     mat4 transform_neg;
     float height = getHeight();
+    int idx_pos = idx;
+    int idx_neg = idx + 1;
+    int idx_pos_constr = idx + 2;
+    int idx_neg_constr = idx + 3;
+    int idx_ref = props.is_construction ? idx + 4 : idx + 2;
 
     if (renderer.m_tlas.size() == 0) std::runtime_error("TLAS haven't been built yet");
     props.position = position;
-    transform = nvmath::translation_mat4(nvmath::vec3f(position.x, position.y + 0.5, position.z)) * 
-         nvmath::scale_mat4(is_hidden ? vec3(0.0f) : nvmath::vec3f(std::abs(eff_scale), height, std::abs(eff_scale)));
+    this->is_placed = true;
+    this->is_hidden = is_hidden;
     transform_pos = nvmath::translation_mat4(nvmath::vec3f(position.x, position.y + 0.5, position.z)) * 
          nvmath::rotation_mat4_x(props.rotation.x) * 
          nvmath::rotation_mat4_z(props.rotation.y) * 
@@ -93,12 +90,21 @@ float DataItem::getHeight() {
     return height;
 }
 
-std::vector<vec3> DataItem::split(float n, float& w, float& h) {
+mat4 DataItem::getTransform(vec3 position, float scale, float height) {
+    float eff_scale = std::min(MAX_SIZE, std::abs(scale)) * (scale / std::abs(scale));
+    return nvmath::translation_mat4(nvmath::vec3f(position.x, position.y + 0.5, position.z)) * 
+         nvmath::scale_mat4(nvmath::vec3f(std::abs(eff_scale), height, std::abs(eff_scale)));
+}
+
+int DataItem::splitSize(float n) {
+    return ceil(std::max(n, 1.f));
+}
+
+void DataItem::split(float n, float scale, float height, vec3 *result, float& w, float& h) {
     n = std::max(n, 1.f);
     int nrows, ncols, nlrs;                         // The last one is number of layers
-    float height = getHeight();
 
-    float di_volume = props.scale * props.scale * height;    // Height is 1. scale x scale x 1
+    float di_volume = scale * scale * height;    // Height is 1. scale x scale x 1
     float point_volume = di_volume / n;
     float point_height = cbrt(point_volume);
     nlrs = floor(height / point_height);
@@ -111,28 +117,36 @@ std::vector<vec3> DataItem::split(float n, float& w, float& h) {
     ncols = nrows;
     w = 1.0 / nrows;
 
-
-    std::vector<vec3> result;
-    result.reserve(n);
-    for (int layer = 0; layer < nlrs; layer++) {
-        for (int row = 0; row < nrows; row++) {
-            for (int col = 0; col < ncols; col++) {
-                vec3 prt_pos = vec3(row * w, layer * h, col * w);
-                prt_pos += vec3(w / 2, h / 2, w / 2);
-                prt_pos -= vec3(0.5);
-                result.push_back(prt_pos);
+    // The layout only depends on these, so it's built once and copied afterwards
+    int count = splitSize(n);
+    uint64_t key = ((uint64_t)count << 40) | ((uint64_t)nlrs << 20) | nrows;
+    auto it = split_layouts.find(key);
+    if (it == split_layouts.end()) {
+        if (split_layouts.size() >= SPLIT_CACHE_SIZE) split_layouts.clear();
+
+        std::vector<vec3> layout;
+        layout.reserve(count);
+        for (int layer = 0; layer < nlrs; layer++) {
+            for (int row = 0; row < nrows; row++) {
+                for (int col = 0; col < ncols; col++) {
+                    vec3 prt_pos = vec3(row * w, layer * h, col * w);
+                    prt_pos += vec3(w / 2, h / 2, w / 2);
+                    prt_pos -= vec3(0.5);
+                    layout.push_back(prt_pos);
+                }
             }
         }
-    }
 
-    for (int residual = 0; residual < (n - nrows * ncols * nlrs); residual++) {
-        float x = (float)(rand() % 100) / 100 - 0.5;
-        float y = (float)(rand() % 100) / 100 - 0.5;
-        float z = (float)(rand() % 100) / 100 - 0.5;
-        result.push_back(vec3(x, y, z));
+        for (int residual = 0; residual < (n - nrows * ncols * nlrs); residual++) {
+            float x = (float)(rand() % 100) / 100 - 0.5;
+            float y = (float)(rand() % 100) / 100 - 0.5;
+            float z = (float)(rand() % 100) / 100 - 0.5;
+            layout.push_back(vec3(x, y, z));
+        }
+        it = split_layouts.emplace(key, std::move(layout)).first;
     }
 
-    return result;
+    std::copy(it->second.begin(), it->second.end(), result);
 }
 
 void DataItem::setScale(float scale, float scale_ref) {
@@ -142,10 +156,12 @@ void DataItem::setScale(float scale, float scale_ref) {
 }
 
 void DataItem::hide() {
+    if (is_placed && is_hidden) return;
     moveTo(props.position, true);
 }
 
 void DataItem::show() {
+    if (is_placed && !is_hidden) return;
     setScale(props.scale, props.scale_ref);
 }
 
@@ -238,79 +254,83 @@ vec3 BCurve::eval(float t) const {
             + 3 * float((1 - t) * pow(t, 2)) * p3 + float(pow(t, 3)) * p4;
 }
 
-DISet::DISet(Renderer &renderer, vec3 pos) {
+void WeightsBlock::resize(int n, int n_fields) {
+    this->n = n;
+    block.assign(n * n_fields, 0.0f);
+}
+
+vec3 WeightsBlock::getVec3(int field, int i) const {
+    return vec3((*this)[field][i], (*this)[field + 1][i], (*this)[field + 2][i]);
+}
+
+void WeightsBlock::setVec3(int field, int i, vec3 value) {
+    (*this)[field][i] = value.x;
+    (*this)[field + 1][i] = value.y;
+    (*this)[field + 2][i] = value.z;
+}
+
+void DISets::add(Renderer &renderer, vec3 pos, int layer) {
     DIProperties props;
     props = {
         .is_has_reference = true,
         .is_construction = false,
         .position = pos,
-        .height = 1.5f,
+        .height = DISET_HEIGHT,
         .scale = 1.0f,
         .scale_ref = 1.0f
     };
-    DataItem di(renderer, props, renderer.indices);
-    components.push_back(di);
+    components.push_back(DataItem(renderer, props, renderer.indices));
 
     props.rotation = {3.14159/2, 0};
     props.is_has_reference = false;
-    DataItem di2(renderer, props, renderer.indices);
-    components.push_back(di2);
+    components.push_back(DataItem(renderer, props, renderer.indices));
 
     props.rotation = {0, 3.14159/2};
-    DataItem di3(renderer, props, renderer.indices);
-    components.push_back(di3);
+    components.push_back(DataItem(renderer, props, renderer.indices));
 
-    transform = components[0].transform;
-}
-
-void DISet::moveTo(vec3 position, bool is_hidden) {
-    for (DataItem &c : components) {
-        c.moveTo(position, is_hidden || this->is_hidden);
-    }
-    transform = components[0].transform;
+    layers.push_back(layer);
+    hidden.push_back(false);
+    hidden_perm.push_back(false);
 }
 
-std::vector<vec3> DISet::split(float n, float& w, float& h) {
-    return components[0].split(n, w, h);
+int DISets::size() const {
+    return layers.size();
 }
 
-void DISet::setScale(float scale, float scale_ref) {
-    if (this->is_hidden) return;
-    for (DataItem &c : components) {
-        if (c.props.scale != scale || c.props.scale_ref != scale_ref) c.setScale(scale, scale_ref);
-    }
-    transform = components[0].transform;
+vec3 DISets::getPosition(int i) {
+    return components[3 * i].props.position;
 }
 
-void DISet::hide(bool isPerm) {
-    is_hidden = true;
-    if (isPerm) is_hidden_perm = true;
-    for (DataItem &c : components) {
-        c.hide();
+void DISets::moveTo(int i, vec3 position, bool is_hidden) {
+    for (int c = 3 * i; c < 3 * i + 3; c++) {
+        components[c].moveTo(position, is_hidden || hidden[i]);
     }
 }
 
-void DISet::show(bool isPerm) {
-    is_hidden = false;
-    if (isPerm) is_hidden_perm = false;
-    for (DataItem &c : components) {
-        c.show();
+void DISets::setScale(int i, float scale, float scale_ref) {
+    if (hidden[i]) return;
+    for (int c = 3 * i; c < 3 * i + 3; c++) {
+        if (components[c].props.scale != scale || components[c].props.scale_ref != scale_ref) components[c].setScale(scale, scale_ref);
     }
 }
 
-void DISet::showStatic() {
-    for (DataItem &c : components) {
-        c.showStatic();
+void DISets::hide(int i, bool isPerm) {
+    hidden[i] = true;
+    if (isPerm) hidden_perm[i] = true;
+    for (int c = 3 * i; c < 3 * i + 3; c++) {
+        components[c].hide();
     }
 }
 
-void DISet::hideStatic() {
-    for (DataItem &c : components) {
-        c.hideStatic();
+void DISets::show(int i, bool isPerm) {
+    hidden[i] = false;
+    if (isPerm) hidden_perm[i] = false;
+    for (int c = 3 * i; c < 3 * i + 3; c++) {
+        components[c].show();
     }
 }
 
-void Filter::_Filter(Renderer& renderer, std::vector<unsigned long> weights_shape, std::vector<double> weights_data, float bias, int outLayer) {
+void Filter::_Filter(Renderer& renderer, std::vector<unsigned long> weights_shape, std::vector<double> weights_data, float bias, int outLayer, int groups) {
     this->bias = bias;
     width = weights_shape[2];
     height = weights_shape[3];
@@ -319,25 +339,28 @@ void Filter::_Filter(Renderer& renderer, std::vector<unsigned long> weights_shap
     int idx = 0;
     int itemsPerOutLayer = width * height * weights_shape[1];
     int itemsPerInLayer = width * height;
+    // The group's input channels come one after another, starting from this one
+    int groupLayer = outLayer / (weights_shape[0] / groups) * weights_shape[1];
+    window_size = itemsPerOutLayer * groups;
     DIProperties props;
+    weights.resize(itemsPerOutLayer, WEIGHT_FIELDS);
+    weights_src.resize(itemsPerOutLayer);
     for (double value : weights_data) {
         int layer = idx / itemsPerOutLayer;
         // std::cout << idx << '\t' << layer << '\t' << value << std::endl;
         if (layer % weights_shape[0] == outLayer) {
             int layer_idx = idx % itemsPerOutLayer;
-            weights.push_back(value);
-            weights_scales.push_back({value, 1});
-            weights_positions.push_back(vec3(-1));
-            weights_scales_old.push_back({value, 1});
-            weights_positions_old.push_back(vec3(-1));
-            float pos_x = layer_idx / weights_shape[3];
-            float pos_y = layer_idx % weights_shape[3];
+            int window_idx = layer_idx + groupLayer * itemsPerInLayer;
+            weights[WEIGHT_VALUE][layer_idx] = value;
+            weights[WEIGHT_SCALE_OLD][layer_idx] = value;
+            weights[WEIGHT_TARGET_SCALE_OLD][layer_idx] = 1;
+            weights_src[layer_idx] = window_idx;
+            float pos_x = window_idx / weights_shape[3];
+            float pos_y = window_idx % weights_shape[3];
             pos_x *= SPACING;
             pos_y *= SPACING;
 
-            DISet diset(renderer, vec3(pos_x, 1.5, pos_y));
-            diset.layer = layer_idx / itemsPerInLayer;
-            weights_di.push_back(diset);
+            weights_di.add(renderer, vec3(pos_x, 1.5, pos_y), window_idx / itemsPerInLayer);
         }
         idx++;
     }
@@ -352,9 +375,9 @@ void Filter::_Filter(Renderer& renderer, std::vector<unsigned long> weights_shap
     dst = new DataItem(renderer, props, renderer.indices);
 }
 
-Filter::Filter(Renderer& renderer, std::vector<unsigned long> weights_shape, std::vector<double> weights_data, float bias, int outLayer) 
+Filter::Filter(Renderer& renderer, std::vector<unsigned long> weights_shape, std::vector<double> weights_data, float bias, int outLayer, int groups) 
         : renderer(renderer), bias(bias) {
-    _Filter(renderer, weights_shape, weights_data, bias, outLayer);
+    _Filter(renderer, weights_shape, weights_data, bias, outLayer, groups);
 }
 
 Filter::Filter(Renderer& renderer, std::string weightsPath, int outLayer) : renderer(renderer) {
@@ -374,118 +397,129 @@ Filter::~Filter()
     delete dst;
 }
 
-void Filter::init(FilterProps props, float time_offset) {
-    this->time_offset = time_offset;
-    if (this->props.dst) this->props.dst->show();
-    this->props = props;
-    if (this->props.dst) this->props.dst->hide();
-    // Clean up previously used particles
+void Filter::copyWeights(const Filter &other) {
+    if (other.weights.size() != weights.size() || other.window_size != window_size) {
+        throw std::runtime_error("Filter shapes does not match");
+    }
+    std::copy(other.weights[WEIGHT_VALUE], other.weights[WEIGHT_VALUE] + weights.size(), weights[WEIGHT_VALUE]);
+    weights_src = other.weights_src;
+    bias = other.bias;
+    for (int i = 0; i < weights_di.size(); i++) {
+        weights_di.layers[i] = other.weights_di.layers[i];
+        if (other.weights_di.hidden_perm[i]) weights_di.hide(i, true);
+        else weights_di.hidden_perm[i] = false;
+    }
+}
+
+void Filter::release() {
+    if (props.dst) props.dst->show();
+    props.dst = 0;
     for (Particle* p : particles) {
         delete p;
     }
     particles.clear();
-    curves.clear();
-    di_curves_start.clear();
-    di_curves_mid.clear();
-    di_curves_end.clear();
-    movement_offsets.clear();
+    window = nullptr;
+    dst->hideStatic();
     dst->hide();
-    if (props.src.size() != weights.size()) {
+    hide_layer(-1);
+}
+
+std::shared_ptr<FilterWindow> Filter::prepare(const FilterProps &props, float time_offset) {
+    if (props.src.size() != window_size) {
         throw std::runtime_error("Data slice and filter sizes does not match");
     }
 
-    result_value = 0;
-    float result_x = 0;
-    float result_y = 0;
-    float result_z = 0;
-    // std::cout << std::endl << "Calculating window:" << std::endl;
-    for (int i = 0; i < props.src.size(); i++) {
-        float applied_value = props.src[i]->props.scale * weights[i];
-        // std::cout << props.src[i]->props.scale << ' ' << weights[i] << std::endl;
-        result_value += applied_value;
-        vec3 target_pos = props.src[i]->props.position;
-
-        result_x += target_pos.x;
-        result_y += target_pos.z;
-        result_z += target_pos.y;
-        movement_offsets.push_back(((float)(rand() % 100) / 100 - 0.5) * TIME_OFFSET_DI_MOVEMENT);
-
-        float target_scale = props.src[i]->props.scale;
-        // target_pos.y += 0.5;
-        // std::cout << i << '\t' << props.src[i]->props.scale << '\t' << weights[i] << '\t' << applied_value << '\t' << result_value << std::endl;
-
-        weights_scales_old[i] = weights_scales[i];
-        weights_positions_old[i] = weights_positions[i].y >= 0 ? weights_positions[i] : target_pos;
-        weights_scales[i] = {applied_value, target_scale};
-        weights_positions[i] = target_pos;
-
-        weights_di[i].moveTo(weights_positions_old[i]);
-        weights_di[i].setScale(weights_scales_old[i].first, std::abs(weights_scales_old[i].second) + 0.001);
+    std::shared_ptr<FilterWindow> window = std::make_shared<FilterWindow>();
+    window->props = props;
+    window->result_value = 0;
+    window->weights.resize(weights.size(), WINDOW_FIELDS);
+    const float *values = weights[WEIGHT_VALUE];
+    float *scales = window->weights[WINDOW_SCALE];
+    for (int i = 0; i < weights.size(); i++) {
+        const DataItem *src = props.src[weights_src[i]];
+        float applied_value = src->props.scale * values[i];
+        window->result_value += applied_value;
+        scales[i] = applied_value;
+        window->weights[WINDOW_TARGET_SCALE][i] = src->props.scale;
+        window->weights[WINDOW_MOVEMENT_OFFSET][i] = ((float)(rand() % 100) / 100 - 0.5) * TIME_OFFSET_DI_MOVEMENT;
+        window->weights.setVec3(WINDOW_POSITION, i, src->props.position);
+    }
+    if (std::abs(window->result_value + bias - props.dst->props.scale) > 1e-6) {
+        throw std::runtime_error("Generated and given result won't match");
+    }
 
+    std::vector<int> &offsets = window->weights_particles_offsets;
+    offsets.resize(weights.size() + 1);
+    offsets[0] = 0;
+    for (int i = 0; i < weights.size(); i++) {
+        // Zero contribution has nothing to split
+        offsets[i + 1] = offsets[i] + (scales[i] == 0 ? 0 : DataItem::splitSize(props.prts_per_size * std::abs(scales[i])));
     }
-    if (std::abs(result_value + bias - props.dst->props.scale) > 1e-6) {
-        throw std::runtime_error("Generated and given result won't match");
+    window->weights_particles.resize(offsets.back());
+
+    for (int i = 0; i < weights.size(); i++) {
+        float applied_value = scales[i];
+        if (applied_value == 0) continue;
+        vec3 *particles = window->weights_particles.data() + offsets[i];
+        float w, h;
+        float height = DISET_HEIGHT * (std::abs(window->weights[WINDOW_TARGET_SCALE][i]) + 0.001);
+        mat4 weight_transform = DataItem::getTransform(window->weights.getVec3(WINDOW_POSITION, i), applied_value, height);
+        DataItem::split(props.prts_per_size * std::abs(applied_value), applied_value, height, particles, w, h);
+        for (int p = 0; p < offsets[i + 1] - offsets[i]; p++) {
+            particles[p] = (vec3)(weight_transform * vec4(particles[p], 1));
+        }
     }
 
-    dst->setScale(result_value);
-    // dst->moveTo(vec3(result_x / weights.size(), result_z / weights.size() + LAYER_HEIGHT, result_y / weights.size()));
-    dst->moveTo(props.dst->props.position);
+    prepare_prt_curves(*window, time_offset);
+    return window;
 }
 
-void Filter::init_prt_curves() {
+void Filter::prepare_prt_curves(FilterWindow &window, float time_offset) {
     std::vector<vec3> particles_pos;
     std::vector<vec3> particles_neg;
     vec3 *particles_constructing;
-    int n_mrg_particles, n_constr_particles;
-    int i = 0;
-
-    // Split the filter's weights into particles
-    for (DISet &weight_di : weights_di) {
-        for (vec3 prt : weight_di.split(props.prts_per_size * std::abs(weights_scales[i].first), prt_w, prt_h)) {
-            if (weights_scales[i].first > 0) {
-                particles_pos.push_back((vec3)(weight_di.transform * vec4(prt, 1)));
-            } else {
-                particles_neg.push_back((vec3)(weight_di.transform * vec4(prt, 1)));
-            }
-        }
-        i++;
+    int n_mrg_particles;
+
+    // The weights' particles, at the place where the scale stage leaves the DISets
+    particles_pos.reserve(window.weights_particles.size());
+    particles_neg.reserve(window.weights_particles.size());
+    for (int i = 0; i < weights.size(); i++) {
+        std::vector<vec3> &dst_particles = window.weights[WINDOW_SCALE][i] > 0 ? particles_pos : particles_neg;
+        dst_particles.insert(dst_particles.end(), window.weights_particles.begin() + window.weights_particles_offsets[i],
+            window.weights_particles.begin() + window.weights_particles_offsets[i + 1]);
     }
     
     // Separate the particles into constructing and merging
-    particles.reserve(particles_pos.size() + particles_neg.size());
     if (particles_pos.size() > particles_neg.size()) {
-        n_constr_particles = particles_pos.size() - particles_neg.size();
+        window.n_constr_particles = particles_pos.size() - particles_neg.size();
         n_mrg_particles = particles_neg.size();
-        particles_constructing = &(particles_pos[particles_pos.size() - n_constr_particles]);
+        particles_constructing = particles_pos.data() + n_mrg_particles;
     } else {
-        n_constr_particles = particles_neg.size() - particles_pos.size();
+        window.n_constr_particles = particles_neg.size() - particles_pos.size();
         n_mrg_particles = particles_pos.size();
-        particles_constructing = &(particles_neg[particles_neg.size() - n_constr_particles]);
+        particles_constructing = particles_neg.data() + n_mrg_particles;
     }
+    window.curves.reserve(window.n_constr_particles + 2 * n_mrg_particles);
 
     // Set up movement of the constructing particles
-    std::vector<vec3> prts_end = dst->split(n_constr_particles, prt_w, prt_h);
+    float dst_height = std::abs(window.result_value);
+    mat4 dst_transform = DataItem::getTransform(window.props.dst->props.position, window.result_value, dst_height);
+    split_buffer.resize(DataItem::splitSize(window.n_constr_particles));
+    DataItem::split(window.n_constr_particles, window.result_value, dst_height, split_buffer.data(), window.prt_w, window.prt_h);
 
-    for (int i = 0; i < prts_end.size(); i++) {
+    for (int i = 0; i < window.n_constr_particles; i++) {
         if (nvmath::length(particles_constructing[i]) > MAX_POSITION) {
             throw std::runtime_error("Position too large");
         }
 
         BCurve curve;
         // Duration -0.5 : 1.5 + CONSTRUCTION_DELAY
-        curve.time_offset = ((float)(rand() % 100) / 100 - 0.5) * time_offset + (float)i / prts_end.size() - CONSTRUCTION_DELAY;
+        curve.time_offset = ((float)(rand() % 100) / 100 - 0.5) * time_offset + (float)i / window.n_constr_particles - CONSTRUCTION_DELAY;
         curve.p1 = particles_constructing[i];
-        curve.p4 = vec3(dst->transform * vec4(prts_end[i], 1));
+        curve.p4 = vec3(dst_transform * vec4(split_buffer[i], 1));
         curve.p3 = curve.p4 - vec3(0, 0.5, 0);
         curve.p2 = curve.p1 + vec3(0, 1.0, 0);
-        curves.push_back(curve);
-
-        PRTProperties prtProps = {
-            .is_positive = dst->props.scale > 0,
-            .is_splashing = false,
-            .position = particles_constructing[i]
-        };
-        particles.push_back(new Particle(renderer, prtProps, renderer.indices));
+        window.curves.push_back(curve);
     }
 
     // Set up movement of the merging particles
@@ -502,22 +536,69 @@ void Filter::init_prt_curves() {
         curve.p4 = mrg_pt;
         curve.p3 = curve.p4 - 0.5f * dist_vector;
         curve.p2 = curve.p1 + vec3(0, 1.0, 0);
-        curves.push_back(curve);
+        window.curves.push_back(curve);
 
         curve.p1 = start_pt2;
         curve.p3 = curve.p4 + 0.5f * dist_vector;
         curve.p2 = curve.p1 + vec3(0, 1.0, 0);
-        curves.push_back(curve);
+        window.curves.push_back(curve);
+    }
+}
+
+void Filter::init(FilterProps props, float time_offset) {
+    init(prepare(props, time_offset));
+}
+
+void Filter::init(std::shared_ptr<FilterWindow> window) {
+    if (this->props.dst) this->props.dst->show();
+    this->props = window->props;
+    if (this->props.dst) this->props.dst->hide();
+    // Clean up previously used particles
+    for (Particle* p : particles) {
+        delete p;
+    }
+    particles.clear();
+    di_curves_start.clear();
+    di_curves_mid.clear();
+    di_curves_end.clear();
+    dst->hide();
+
+    float *scales_old = weights[WEIGHT_SCALE_OLD];
+    float *target_scales_old = weights[WEIGHT_TARGET_SCALE_OLD];
+    for (int i = 0; i < weights.size(); i++) {
+        // The weights move from where the previous window left them
+        if (this->window) {
+            scales_old[i] = this->window->weights[WINDOW_SCALE][i];
+            target_scales_old[i] = this->window->weights[WINDOW_TARGET_SCALE][i];
+            weights.setVec3(WEIGHT_POSITION_OLD, i, this->window->weights.getVec3(WINDOW_POSITION, i));
+        } else {
+            scales_old[i] = weights[WEIGHT_VALUE][i];
+            target_scales_old[i] = 1;
+            weights.setVec3(WEIGHT_POSITION_OLD, i, window->weights.getVec3(WINDOW_POSITION, i));
+        }
+
+        // When sliding, most of the DISets are already there
+        vec3 position_old = weights.getVec3(WEIGHT_POSITION_OLD, i);
+        if (weights_di.getPosition(i) != position_old) weights_di.moveTo(i, position_old);
+        weights_di.setScale(i, scales_old[i], std::abs(target_scales_old[i]) + 0.001);
+    }
+    this->window = window;
+
+    dst->setScale(window->result_value);
+    dst->moveTo(props.dst->props.position);
+}
 
+void Filter::init_prt_curves() {
+    const std::vector<BCurve> &curves = window->curves;
+    particles.reserve(curves.size());
+    for (int i = 0; i < curves.size(); i++) {
+        bool is_constructing = i < window->n_constr_particles;
         PRTProperties prtProps = {
-            .is_positive = true,
-            .is_splashing = true,
-            .position = start_pt1
+            .is_positive = is_constructing ? window->result_value > 0 : (i - window->n_constr_particles) % 2 == 0,
+            .is_splashing = !is_constructing,
+            .position = curves[i].p1
         };
         particles.push_back(new Particle(renderer, prtProps, renderer.indices));
-
-        prtProps.is_positive = false;
-        particles.push_back(new Particle(renderer, prtProps, renderer.indices));
     }
 }
 
@@ -533,6 +614,7 @@ void Filter::setStage(float value) {
     float value_merge       = 4;
     float value_bias        = 5;
     float max_value = value_scale;
+    const std::vector<BCurve> &curves = window->curves;
 
     // Reset particles, so they don't hang around in a stage they souldn't be involved
     for(int i = 0; i < particles.size(); i++) {
@@ -541,6 +623,11 @@ void Filter::setStage(float value) {
 
     // DI scale and movement start with random offset, so kept together
     if (di_curves_start.size() == 0) init_di_curves();
+    const float *values = weights[WEIGHT_VALUE];
+    const float *scales_old = weights[WEIGHT_SCALE_OLD];
+    const float *target_scales_old = weights[WEIGHT_TARGET_SCALE_OLD];
+    const float *scales = window->weights[WINDOW_SCALE];
+    const float *target_scales = window->weights[WINDOW_TARGET_SCALE];
     for (int i = 0; i < weights.size(); i++) {
         float value_inner = (value - TIME_OFFSET_DI_MOVEMENT / 2) + di_curves_start[i].time_offset;
         value_inner = value_inner / max_value * (max_value + TIME_OFFSET_DI_MOVEMENT);
@@ -549,44 +636,40 @@ void Filter::setStage(float value) {
         if (value_inner >= 0 && value_inner <= value_unscale) {
             // Unscale stage
             value_inner = (value_inner - 0) * unscale_time;
-            std::pair<float, float> scale = weights_scales_old[i];
-            float weighted_scale = (1 - value_inner) * scale.first + value_inner * weights[i];
-            float weighted_target_scale = (1 - value_inner) * scale.second + value_inner * 1.0;
-            weights_di[i].setScale(weighted_scale, std::abs(weighted_target_scale) + 0.001);
+            float weighted_scale = (1 - value_inner) * scales_old[i] + value_inner * values[i];
+            float weighted_target_scale = (1 - value_inner) * target_scales_old[i] + value_inner * 1.0;
+            weights_di.setScale(i, weighted_scale, std::abs(weighted_target_scale) + 0.001);
         } else if (value_inner > value_unscale && value_inner <= value_move) {
             // Move stage
             value_inner = (value_inner - value_unscale) * move_time;
             vec3 position = get_di_movement_pos(di_curves_start[i], di_curves_mid[i], di_curves_end[i], value_inner / move_time);
-            weights_di[i].moveTo(position);
+            weights_di.moveTo(i, position);
         } else if (value_inner > value_move && value_inner <= value_scale) {
             // Scale stage
             value_inner = (value_inner - value_move) * scale_time;
-            weights_di[i].moveTo(weights_positions[i]);
-            std::pair<float, float> scale = weights_scales[i];
-            std::pair<float, float> scale_old = {weights[i], 1.0};
-            float weighted_scale = value_inner * scale.first + (1 - value_inner) * scale_old.first;
-            float weighted_target_scale = value_inner * scale.second + (1 - value_inner) * scale_old.second;
-            weights_di[i].setScale(weighted_scale, std::abs(weighted_target_scale) + 0.001);
+            weights_di.moveTo(i, window->weights.getVec3(WINDOW_POSITION, i));
+            float weighted_scale = value_inner * scales[i] + (1 - value_inner) * values[i];
+            float weighted_target_scale = value_inner * target_scales[i] + (1 - value_inner) * 1.0;
+            weights_di.setScale(i, weighted_scale, std::abs(weighted_target_scale) + 0.001);
         }
     }
 
     // Particles movement
     if (value > value_scale && value <= value_merge) {
-        if (curves.size() == 0) init_prt_curves();
+        if (particles.size() == 0) init_prt_curves();
 
         float value_inner = (value - value_scale) * merge_time - TIME_OFFSET / 2; // This value should start at negative
         for(int i = 0; i < particles.size(); i++) {
             float curve_value = value_inner + curves[i].time_offset;
             float stage = (curve_value - ANIMATION_DURATION) / TRANSFORM_DURATION;
             // Only width should be scaled. DI height always remains 1.0
-            vec3 scale(prt_w * dst->props.scale, prt_h * dst->props.scale, prt_w * dst->props.scale);
+            vec3 scale(window->prt_w * dst->props.scale, window->prt_h * dst->props.scale, window->prt_w * dst->props.scale);
             // Add scale offset. If the filler and DI overlap, weird things happen.
             scale *= 1.01f;
             float show_transition = curve_value / ANIMATION_DURATION * 100;
             particles[i]->moveTo(curves[i].eval(curve_value / ANIMATION_DURATION), stage, scale, show_transition); 
         }
     } else {
-        curves.clear();
         for (Particle *p : particles) delete p;
         particles.clear();
     }
@@ -594,7 +677,7 @@ void Filter::setStage(float value) {
     // Showing static part when the construction is complete; showing bias
     if (value > value_merge && value <= value_bias) {
         float value_inner = (value - value_merge) * bias_time;
-        float weighted_scale = value_inner * (result_value + bias) + (1 - value_inner) * result_value;
+        float weighted_scale = value_inner * (window->result_value + bias) + (1 - value_inner) * window->result_value;
         dst->setScale(weighted_scale);
         dst->showStatic();
     } else {
@@ -612,26 +695,28 @@ void Filter::setStage(float value) {
 
 void Filter::init_di_curves() {
     for (int i = 0; i < weights.size(); i++) {
-        vec3 dist_vector = nvmath::normalize(weights_positions[i] - weights_positions_old[i]);
+        vec3 position = window->weights.getVec3(WINDOW_POSITION, i);
+        vec3 position_old = weights.getVec3(WEIGHT_POSITION_OLD, i);
+        vec3 dist_vector = nvmath::normalize(position - position_old);
         vec3 vertical_offset = vec3(0, 1, 0);
         float lead_length = 0.2;
 
         BCurve curve;
         curve.time_offset = ((float)(rand() % 100) / 100 - 0.5) * TIME_OFFSET_DI_MOVEMENT;
-        curve.p1 = weights_positions_old[i];
+        curve.p1 = position_old;
         curve.p4 = curve.p1 + vertical_offset;
         curve.p3 = curve.p4 - vertical_offset * lead_length;
         curve.p2 = curve.p1 + vertical_offset * lead_length;
         di_curves_start.push_back(curve);
 
         curve.p1 = curve.p4;
-        curve.p4 = weights_positions[i] + vertical_offset;
+        curve.p4 = position + vertical_offset;
         curve.p3 = curve.p4 - dist_vector * lead_length;
         curve.p2 = curve.p1 + dist_vector * lead_length;
         di_curves_mid.push_back(curve);
 
         curve.p1 = curve.p4;
-        curve.p4 = weights_positions[i];
+        curve.p4 = position;
         curve.p3 = curve.p4 + vertical_offset * lead_length;
         curve.p2 = curve.p1 - vertical_offset * lead_length;
         di_curves_end.push_back(curve);
@@ -657,17 +742,17 @@ vec3 Filter::get_di_movement_pos(const BCurve &start, const BCurve &mid, const B
 
 void Filter::hide_layer(int layer) {
     std::cout << "Hiding layer " << layer << std::endl;
-    for (auto &w : weights_di) {
-        if (layer < 0) w.hide();
-        else if (w.layer == layer) w.hide(true);
+    for (int i = 0; i < weights_di.size(); i++) {
+        if (layer < 0) weights_di.hide(i);
+        else if (weights_di.layers[i] == layer) weights_di.hide(i, true);
     }
 }
 
 void Filter::show_layer(int layer) {
     std::cout << "Showing layer " << layer << std::endl;
-    for (auto &w : weights_di) {
-        if (layer < 0 && !w.is_hidden_perm) w.show();
-        else if (w.layer == layer) w.show(true);
+    for (int i = 0; i < weights_di.size(); i++) {
+        if (layer < 0 && !weights_di.hidden_perm[i]) weights_di.show(i);
+        else if (weights_di.layers[i] == layer) weights_di.show(i, true);
     }
 }
 
@@ -677,6 +762,9 @@ Data::Data(Renderer& renderer, const std::string path, vec3 offset, int layer, f
   depth = layer > 0 ? 1 : d.shape[0];
   width = d.shape[1];
   height = d.shape[2];
+  stride_c = width * height;
+  stride_x = height;
+  stride_y = 1;
   int valsPerLayer = width * height;
   int idx = 0;
   for (double value : d.data) {
@@ -712,23 +800,63 @@ Data::Data(Renderer& renderer, const std::string path, vec3 offset, int layer, f
 std::vector<DataItem*> Data::getRange(int x1, int x2, int y1, int y2) {
     x1 = std::max(0, x1);
     x2 = std::max(x2, x1);
-    x2 = std::min(x2, width);
+    x2 = std::min(x2, width - 1);
     y1 = std::max(0, y1);
     y2 = std::max(y2, y1);
-    y2 = std::min(y2, height);
+    y2 = std::min(y2, height - 1);
 
     std::vector<DataItem*> result;
-    result.reserve((x2 - x1) * (y2 - y1) * depth);
-    for (int i = 0; i < items.size(); i++) {
-        int layer_i = i % (width * height);
-        int y = layer_i % height;
-        int x = layer_i / height;
-        if (x >= x1 && x <= x2 && y >= y1 && y <= y2) result.push_back(&items[i]);
+    if (x1 > x2 || y1 > y2) return result;
+    result.reserve((x2 - x1 + 1) * (y2 - y1 + 1) * depth);
+    for (int c = 0; c < depth; c++) {
+        for (int x = x1; x <= x2; x++) {
+            DataItem *row = &items[c * stride_c + x * stride_x];
+            for (int y = y1; y <= y2; y++) result.push_back(row + y * stride_y);
+        }
     }
 
     return result;
 }
 
+const std::vector<int>& Data::getWindowOffsets(int kernel_w, int kernel_h, int stride) {
+    uint64_t key = ((uint64_t)kernel_w << 40) | ((uint64_t)kernel_h << 20) | (uint64_t)stride;
+    auto it = window_offsets.find(key);
+    if (it != window_offsets.end()) return it->second;
+
+    std::vector<int> &offsets = window_offsets[key];
+    offsets.reserve(depth * kernel_w * kernel_h);
+    for (int c = 0; c < depth; c++) {
+        for (int kx = 0; kx < kernel_w; kx++) {
+            for (int ky = 0; ky < kernel_h; ky++) {
+                offsets.push_back(c * stride_c + kx * stride_x + ky * stride_y);
+            }
+        }
+    }
+    return offsets;
+}
+
+std::vector<DataItem*> Data::getWindow(int x, int y, int kernel_w, int kernel_h, int stride) {
+    int x1 = x * stride;
+    int y1 = y * stride;
+    // Windows hanging over the edge are cropped, the same way getRange does
+    if (x1 < 0 || y1 < 0 || x1 + kernel_w > width || y1 + kernel_h > height) {
+        return getRange(x1, x1 + kernel_w - 1, y1, y1 + kernel_h - 1);
+    }
+
+    const std::vector<int> &offsets = getWindowOffsets(kernel_w, kernel_h, stride);
+    DataItem *first = &items[x1 * stride_x + y1 * stride_y];
+    std::vector<DataItem*> result(offsets.size());
+    for (int i = 0; i < offsets.size(); i++) result[i] = first + offsets[i];
+    return result;
+}
+
+DataItem* Data::getItem(int layer, int x, int y) {
+    if (layer < 0 || layer >= depth || x < 0 || x >= width || y < 0 || y >= height) {
+        throw std::runtime_error("Data item is out of range");
+    }
+    return &items[layer * stride_c + x * stride_x + y * stride_y];
+}
+
 void Data::hide() {
     for (DataItem &i : items) {
         i.hide();
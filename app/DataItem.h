@@ -2,6 +2,8 @@
 #define DATA_ITEM_H
 
 #include <vector>
+#include <memory>
+#include <unordered_map>
 #include "Renderer.h"
 #include "npy.hpp"
 #include "imgui.h"
@@ -12,6 +14,7 @@
 #define MERGE_HEIGHT 3.0
 #define LAYER_HEIGHT 5.0
 #define MAX_POSITION 1000
+#define DISET_HEIGHT 1.5f
 
 // Time constraints
 #define CONSTRUCTION_DELAY 1.5
@@ -23,6 +26,7 @@
 
 // Quantity constraints
 #define RESERVE_PARTICLES 1024 * 1
+#define SPLIT_CACHE_SIZE 4096
 
 
 struct DIProperties {
@@ -45,28 +49,35 @@ class DataItem {
 public:
     Renderer& renderer;
     // vec3 position;
-    mat4 transform;
     int layer;
 
-    // Indices of the models: positive, negative, (construction) positive&negative, reference (glass)
-    int idx_pos;
-    int idx_neg;
-    int idx_pos_constr;
-    int idx_neg_constr;
-    int idx_ref;
+    // Index of the first model; the models follow as positive, negative, (construction) positive&negative, reference (glass)
+    int idx;
 
     bool is_static;
+    // Visibility of the last placement. Repeated hide/show calls are skipped, so they don't touch the TLAS
+    bool is_placed = false;
+    bool is_hidden = false;
     DIProperties props;
 
     DataItem(Renderer &renderer, DIProperties props, const ModelIndices &indices);
     void moveTo(vec3 position, bool is_hidden=false);
-    std::vector<vec3> split(float n, float& w, float& h);
     void setScale(float scale, float scale_ref = 0.0f);
     void hide();
     void show();
     void showStatic();
     void hideStatic();
     float getHeight();
+
+    // Same as the members above, but for a DataItem that is not placed yet
+    static mat4 getTransform(vec3 position, float scale, float height);
+    // Writes splitSize(n) points into result
+    static void split(float n, float scale, float height, vec3 *result, float& w, float& h);
+    static int splitSize(float n);
+
+private:
+    // Split layouts, by number of points and lattice dimensions
+    static std::unordered_map<uint64_t, std::vector<vec3>> split_layouts;
 };
 
 class Particle {
@@ -101,52 +112,103 @@ struct BCurve {
     vec3 eval(float t) const;
 };
 
-class DISet {
+// Per-weight values. Every field is a contiguous float32 array, all of them in a single block
+class WeightsBlock {
 public:
-    std::vector<DataItem> components;
-    mat4 transform;
-    int layer;
-    bool is_hidden = false;
-    bool is_hidden_perm = false;
+    int size() const { return n; }
+    void resize(int n, int n_fields);
+    float* operator[](int field) { return block.data() + field * n; }
+    const float* operator[](int field) const { return block.data() + field * n; }
+    // Vectors take three consecutive fields
+    vec3 getVec3(int field, int i) const;
+    void setVec3(int field, int i, vec3 value);
+
+private:
+    int n = 0;
+    std::vector<float> block;
+};
 
-    DISet(Renderer &renderer, vec3 pos);
-    void moveTo(vec3 position, bool is_hidden=false);
-    std::vector<vec3> split(float n, float& w, float& h);
-    void setScale(float scale, float scale_ref = 0.0f);
-    void hide(bool isPerm=false);
-    void show(bool isPerm=false);
-    void showStatic();
-    void hideStatic();
+// Fields of Filter::weights
+enum WeightField {
+    WEIGHT_VALUE,
+    WEIGHT_SCALE_OLD,           // Scale of the DISet when the animation starts
+    WEIGHT_TARGET_SCALE_OLD,
+    WEIGHT_POSITION_OLD,        // x, y, z
+    WEIGHT_FIELDS = WEIGHT_POSITION_OLD + 3
+};
+
+// Fields of FilterWindow::weights
+enum WindowField {
+    WINDOW_SCALE,               // Applied value
+    WINDOW_TARGET_SCALE,        // Value of the input item
+    WINDOW_MOVEMENT_OFFSET,
+    WINDOW_POSITION,            // x, y, z
+    WINDOW_FIELDS = WINDOW_POSITION + 3
+};
+
+// Everything a Filter derives from a single window position.
+// Doesn't depend on the previously shown window, so it can be prepared ahead and reused
+struct FilterWindow {
+    FilterProps props;
+    float result_value;
+    WeightsBlock weights;
+    std::vector<vec3> weights_particles;        // Splits of all the weights, in world space
+    std::vector<int> weights_particles_offsets; // Where every weight's split starts; the last one is the total
+    std::vector<BCurve> curves;         // Constructing particles first, then pairs of merging ones (positive, negative)
+    int n_constr_particles;
+    float prt_w, prt_h;
+};
+
+// DISets of all the filter weights, addressed by the weight index.
+// Every DISet is three crossed DataItems, stored next to each other
+class DISets {
+public:
+    std::vector<DataItem> components;
+    std::vector<int> layers;
+    std::vector<bool> hidden;
+    std::vector<bool> hidden_perm;
+
+    void add(Renderer &renderer, vec3 pos, int layer);
+    int size() const;
+    vec3 getPosition(int i);
+    void moveTo(int i, vec3 position, bool is_hidden=false);
+    void setScale(int i, float scale, float scale_ref = 0.0f);
+    void hide(int i, bool isPerm=false);
+    void show(int i, bool isPerm=false);
 };
 
 class Filter {
 public:
     FilterProps props;
     Renderer& renderer;
+    std::shared_ptr<FilterWindow> window;
     std::vector<Particle*> particles;
-    std::vector<BCurve> curves;
     std::vector<BCurve> di_curves_start;
     std::vector<BCurve> di_curves_mid;
     std::vector<BCurve> di_curves_end;
-    std::vector<float> movement_offsets;
     DataItem* dst;              // Construction DataItem, part of Filter
-    float result_value;
     int width, height;
-    std::vector<double> weights;
+    int window_size;                // Number of input items in the window, all the input channels included
+    WeightsBlock weights;
+    std::vector<int> weights_src;   // Index of every weight's input item within the window
     double bias = 0.0;
-    std::vector<std::pair<float, float>> weights_scales;
-    std::vector<vec3> weights_positions;
-    std::vector<std::pair<float, float>> weights_scales_old;
-    std::vector<vec3> weights_positions_old;
-    std::vector<DISet> weights_di;
-    float prt_w, prt_h;
-    float time_offset = 0.0;
+    DISets weights_di;
+    std::vector<vec3> split_buffer;
 
     Filter(Renderer& renderer, std::string weightsPath, int outLayer = 0);
-    Filter(Renderer& renderer, std::vector<unsigned long> weights_shape, std::vector<double> weights_data, float bias, int outLayer = 0);
-    void _Filter(Renderer& renderer, std::vector<unsigned long> weights_shape, std::vector<double> weights_data, float bias, int outLayer = 0);
+    // With groups > 1, every output channel only sees its group of input channels (depthwise when groups equals the depth).
+    // Weights outside the group don't exist; no instances are allocated for them
+    Filter(Renderer& renderer, std::vector<unsigned long> weights_shape, std::vector<double> weights_data, float bias, int outLayer = 0, int groups = 1);
+    void _Filter(Renderer& renderer, std::vector<unsigned long> weights_shape, std::vector<double> weights_data, float bias, int outLayer = 0, int groups = 1);
     ~Filter();
+    // Takes over the weights of another filter of the same shape
+    void copyWeights(const Filter &other);
+    // Gives the window back to the data, the filter shows nothing afterwards
+    void release();
+    std::shared_ptr<FilterWindow> prepare(const FilterProps &props, float time_offset);
+    void prepare_prt_curves(FilterWindow &window, float time_offset);
     void init(FilterProps props, float time_offset);
+    void init(std::shared_ptr<FilterWindow> window);
     void init_di_curves();
     void init_prt_curves();
     vec3 get_di_movement_pos(const BCurve &start, const BCurve &mid, const BCurve &end, float value);
@@ -160,14 +222,24 @@ public:
 class Data {
 public:
     int width, height, depth;
+    // Items are a (depth, width, height) tensor; these are its strides
+    int stride_c, stride_x, stride_y;
     std::vector<DataItem> items;
     std::vector<unsigned int> layersVisibility;
     Data(Renderer& renderer, const std::string path, vec3 offset, int layer = -1, float spacing_x = 1, float spacing_y = 1, float spacing_z = 1);
     std::vector<DataItem*> getRange(int x1, int x2, int y1, int y2);
+    // Same as getRange for the kernel at output position (x, y), in O(window)
+    std::vector<DataItem*> getWindow(int x, int y, int kernel_w, int kernel_h, int stride);
+    DataItem* getItem(int layer, int x, int y);
     void hide();
     void show();
     void hide_layer(int layer);
     void show_layer(int layer);
+
+private:
+    // Offsets of the window items from its first one, by (kernel, stride)
+    std::unordered_map<uint64_t, std::vector<int>> window_offsets;
+    const std::vector<int>& getWindowOffsets(int kernel_w, int kernel_h, int stride);
 };
 
 #endif
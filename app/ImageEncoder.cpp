@@ -0,0 +1,154 @@
+#include "ImageEncoder.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "stb_image_write.h"
+
+#define FLOAT_ONE_BITS 0x3F800000u
+
+static float fromBits(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// The formula the table replaces
+static uint8_t gammaQuantize(float val) {
+    val = pow(val, 1 / 2.2);
+    val *= 255;
+    if (val > 255) val = 255;
+    if (val < 0) val = 0;
+    return (uint8_t)val;
+}
+
+GammaTable::GammaTable() {
+    // Positive floats are ordered like their bits, and within a 64K block the output grows by one at most
+    thresholds[0] = 0;
+    thresholds[256] = INFINITY;
+    for (int k = 1; k < 256; k++) {
+        uint32_t lo = 0, hi = FLOAT_ONE_BITS;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (gammaQuantize(fromBits(mid)) >= k) hi = mid;
+            else lo = mid + 1;
+        }
+        thresholds[k] = fromBits(lo);
+    }
+    base.resize((FLOAT_ONE_BITS >> 16) + 1);
+    for (uint32_t i = 0; i < base.size(); i++) base[i] = gammaQuantize(fromBits(i << 16));
+}
+
+uint8_t GammaTable::operator()(float value) const {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if ((int32_t)bits <= 0) return 0;
+    if (bits >= FLOAT_ONE_BITS) return 255;
+    uint8_t out = base[bits >> 16];
+    return out + (value >= thresholds[out + 1]);
+}
+
+void GammaTable::convert(const float *in, uint8_t *out, size_t n) const {
+    for (size_t i = 0; i < n; i++) out[i] = (*this)(in[i]);
+}
+
+ImageEncoder::ImageEncoder(int n_threads, int max_queued) {
+    // The render thread keeps a core
+    if (n_threads <= 0) n_threads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+    this->max_queued = max_queued > 0 ? max_queued : 2 * n_threads;
+    for (int i = 0; i < n_threads; i++) threads.emplace_back(&ImageEncoder::run, this);
+}
+
+ImageEncoder::~ImageEncoder() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_stopping = true;
+    }
+    queue_cv.notify_all();
+    for (std::thread &thread : threads) thread.join();
+}
+
+uint64_t ImageEncoder::submit(const std::string &filename, int width, int height, const float *pixels, OutputSink *sink) {
+    return push({0, filename, width, height, pixels, nullptr, sink ? sink : &png});
+}
+
+uint64_t ImageEncoder::submit(const std::string &filename, int width, int height, const uint8_t *pixels, OutputSink *sink) {
+    return push({0, filename, width, height, nullptr, pixels, sink ? sink : &png});
+}
+
+uint64_t ImageEncoder::repeat(const std::string &previous, const std::string &filename, OutputSink *sink) {
+    return push({0, filename, 0, 0, nullptr, nullptr, sink ? sink : &png, previous});
+}
+
+uint64_t ImageEncoder::push(Job job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    space_cv.wait(lock, [this]() { return queue.size() < max_queued; });
+    uint64_t ticket = next_ticket++;
+    job.ticket = ticket;
+    queue.push_back(std::move(job));
+    in_flight.insert(ticket);
+    lock.unlock();
+    queue_cv.notify_one();
+    return ticket;
+}
+
+void ImageEncoder::wait(uint64_t ticket) {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&]() { return in_flight.count(ticket) == 0; });
+}
+
+void ImageEncoder::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this]() { return in_flight.empty(); });
+}
+
+void ImageEncoder::setCompression(int level) {
+    // stb reads it while encoding
+    wait();
+    stbi_write_png_compression_level = level;
+}
+
+int ImageEncoder::getCompression() const {
+    return stbi_write_png_compression_level;
+}
+
+void ImageEncoder::run() {
+    std::vector<uint8_t> data;
+    std::string frame;      // The sink's form of the pixels
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queue_cv.wait(lock, [this]() { return !queue.empty() || is_stopping; });
+            if (queue.empty()) return;
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+        space_cv.notify_one();
+
+        const bool is_repeat = !job.previous.empty();
+        const uint8_t *rgba8 = job.rgba8;
+        if (!rgba8 && !is_repeat) {
+            data.resize(job.width * job.height * 4);
+            gamma.convert(job.pixels, data.data(), data.size());
+            rgba8 = data.data();
+        }
+        // Only the writes take turns, the conversions run in parallel
+        if (!is_repeat) job.sink->prepare(job.width, job.height, rgba8, frame);
+        if (is_repeat || job.sink->isOrdered()) {
+            // Tickets go in the submission order; the jobs before this one are all written once it's the oldest
+            std::unique_lock<std::mutex> lock(mutex);
+            done_cv.wait(lock, [&]() { return *in_flight.begin() == job.ticket; });
+        }
+        if (is_repeat) {
+            job.sink->repeat(job.previous, job.filename);
+        } else {
+            job.sink->write(job.filename, job.width, job.height, rgba8, frame);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_flight.erase(job.ticket);
+        }
+        done_cv.notify_all();
+    }
+}
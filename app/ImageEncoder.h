@@ -0,0 +1,78 @@
+#ifndef IMAGE_ENCODER_H
+#define IMAGE_ENCODER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "OutputSink.h"
+
+// Gamma and quantization of the post shader, min(255, pow(v, 1 / 2.2) * 255), as a table lookup.
+// Gives the same bytes as the formula for every float
+class GammaTable {
+public:
+    GammaTable();
+    uint8_t operator()(float value) const;
+    void convert(const float *in, uint8_t *out, size_t n) const;
+    // 257 values, output k for values from thresholds[k] up to thresholds[k + 1]
+    const float *getThresholds() const { return thresholds; }
+
+private:
+    std::vector<uint8_t> base;      // Output at the start of every 64K block of float bit patterns
+    float thresholds[257];          // Smallest value giving every output
+};
+
+// Converts rendered RGBA32F images to 8 bits and writes them to a sink, PNG by default, on a pool of threads.
+// The queue is bounded; submitting to a full one waits for a free place
+class ImageEncoder {
+public:
+    ImageEncoder(int n_threads = 0, int max_queued = 0);
+    ~ImageEncoder();
+    // The pixels and the sink must stay valid until the job is done, see wait. Returns the job ticket
+    uint64_t submit(const std::string &filename, int width, int height, const float *pixels, OutputSink *sink = nullptr);
+    // Already converted to RGBA8, only written
+    uint64_t submit(const std::string &filename, int width, int height, const uint8_t *pixels, OutputSink *sink = nullptr);
+    // Writes the image of the job before it again, under another name
+    uint64_t repeat(const std::string &previous, const std::string &filename, OutputSink *sink = nullptr);
+    // Until the job is written
+    void wait(uint64_t ticket);
+    // Until every submitted job is written
+    void wait();
+    // zlib effort of stb; it doesn't go below 5
+    void setCompression(int level);
+    int getCompression() const;
+    const GammaTable &getGamma() const { return gamma; }
+
+private:
+    struct Job {
+        uint64_t ticket;
+        std::string filename;
+        int width;
+        int height;
+        const float *pixels;
+        const uint8_t *rgba8;
+        OutputSink *sink;
+        std::string previous;   // Name of the image repeated, if it's a repeat
+    };
+    GammaTable gamma;
+    PngSink png;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable queue_cv;   // A job was queued, or the encoder stops
+    std::condition_variable space_cv;   // A job was taken from the queue
+    std::condition_variable done_cv;    // A job was written; ordered sinks wait for it too
+    std::deque<Job> queue;
+    std::set<uint64_t> in_flight;       // Queued or being written
+    uint64_t next_ticket = 1;
+    int max_queued;
+    bool is_stopping = false;
+
+    uint64_t push(Job job);
+    void run();
+};
+
+#endif
@@ -1,5 +1,39 @@
 #include "Layers.h"
 
+WindowCache::WindowCache(size_t capacity) : capacity(capacity) {
+}
+
+std::shared_ptr<FilterWindow> WindowCache::get(const WindowKey &key) {
+    auto it = index.find(key);
+    if (it == index.end()) return nullptr;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second;
+}
+
+void WindowCache::put(const WindowKey &key, std::shared_ptr<FilterWindow> window) {
+    auto it = index.find(key);
+    if (it != index.end()) {
+        it->second->second = window;
+        entries.splice(entries.begin(), entries, it->second);
+        return;
+    }
+    entries.push_front({key, window});
+    index[key] = entries.begin();
+    if (entries.size() > capacity) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+}
+
+bool WindowCache::contains(const WindowKey &key) const {
+    return index.find(key) != index.end();
+}
+
+void WindowCache::clear() {
+    entries.clear();
+    index.clear();
+}
+
 Layer::Layer(std::string name, Renderer &renderer, Data &input, Data &output) 
         : name(name), renderer(renderer), input(input), output(output) {
     // NewState and State values differ, so that an update is triggered immideately
@@ -15,6 +49,46 @@ Layer::Layer(std::string name, Renderer &renderer, Data &input, Data &output)
     }
 }
 
+void Layer::link(std::vector<Layer*> &layers) {
+    for (Layer *layer : layers) {
+        layer->upstream.clear();
+        layer->downstream.clear();
+    }
+    for (Layer *producer : layers) {
+        for (Layer *consumer : layers) {
+            if (&producer->output != &consumer->input) continue;
+            producer->downstream.push_back(consumer);
+            consumer->upstream.push_back(producer);
+        }
+    }
+}
+
+std::vector<Layer*> Layer::getUpstream() {
+    std::vector<Layer*> result;
+    std::function<void(Layer*)> visit = [&](Layer *layer) {
+        for (Layer *producer : layer->upstream) {
+            if (std::find(result.begin(), result.end(), producer) != result.end()) continue;
+            visit(producer);
+            result.push_back(producer);
+        }
+    };
+    visit(this);
+    return result;
+}
+
+std::vector<Layer*> Layer::getDownstream() {
+    std::vector<Layer*> result;
+    std::function<void(Layer*)> visit = [&](Layer *layer) {
+        for (Layer *consumer : layer->downstream) {
+            if (std::find(result.begin(), result.end(), consumer) != result.end()) continue;
+            result.push_back(consumer);
+            visit(consumer);
+        }
+    };
+    visit(this);
+    return result;
+}
+
 void Layer::drawGui() {
     ImGui::Text("Base layer. You shouldn't see this.");
 }
@@ -29,6 +103,14 @@ void Layer::setupSequencer(VRaF::Sequencer &sequencer) {
     std::cout << "Calling plain Layer setupSequencer" << std::endl;
 }
 
+void Layer::prefetch(VRaF::Sequencer &sequencer) {
+    // Nothing to prepare ahead by default
+}
+
+void Layer::allocateSweep() {
+    // No sweep mode by default
+}
+
 bool Layer::update() {
     // throw std::runtime_error("Calling plain Layer update");
     // std::cout << "Calling plain Layer update" << std::endl;
@@ -36,17 +118,21 @@ bool Layer::update() {
 }
 
 void Layer::toMax() {
+    if (level == LEVEL_MAX) return;
     std::cout << "Calling " << name << " toMax" << std::endl;
     newState.time = getMaxTime();
     output.show();
     update();
+    level = LEVEL_MAX;
 }
 
 void Layer::toMin() {
+    if (level == LEVEL_MIN) return;
     std::cout << "Calling " << name << " toMin" << std::endl;
     newState.time = getMinTime();
     output.hide();
     update();
+    level = LEVEL_MIN;
 }
 
 float Layer::getMaxTime() {
@@ -69,6 +155,10 @@ int Layer::getDepth() {
     return output.depth;
 }
 
+int Layer::getSweep() {
+    return 1;
+}
+
 void Conv::_Conv() {
     newState.time = min_time;
     newState.pos.x = filter_x;
@@ -93,6 +183,7 @@ Conv::Conv(std::string name, Renderer &renderer, Data &input, Data &output, std:
     }
     if (filters.size() == 0) throw std::runtime_error("Filters are empty");
     active_filter = filters[filter_idx];
+    make_sweep_filter = [this, weights_path]() { return new Filter(this->renderer, weights_path, 0); };
 
     _Conv();
 }
@@ -101,10 +192,8 @@ void Conv::drawGui() {
     auto filter_pos = [&]() {
         newState.pos.x = filter_x;
         newState.pos.y = filter_y;
-        filterProps.src = input.getRange(filter_x * stride, filter_x * stride + active_filter->width - 1, 
-                filter_y * stride, filter_y * stride + active_filter->height - 1);
-        filterProps.dst = output.getRange(filter_x, filter_x, filter_y, filter_y)[filter_idx];
-        active_filter->init(filterProps, TIME_OFFSET);
+        active_filter->init(getWindow(filter_idx, filter_x, filter_y));
+        initSweep();
         newState.time = min_time;
     };
     if (ImGui::SliderInt((std::string("Filter index##") + name).c_str(), &filter_idx, 0, output.depth - 1)) {
@@ -119,6 +208,10 @@ void Conv::drawGui() {
     if (ImGui::SliderInt((std::string("Filter Y##") + name).c_str(), &filter_y, 0, (input.height - active_filter->height) / stride)) {
         filter_pos();
     }
+    int sweep = getSweep();
+    if (ImGui::SliderInt((std::string("Sweep windows##") + name).c_str(), &sweep, 1, SWEEP_WINDOWS)) {
+        newState.sweep = sweep;
+    }
     if (ImGui::SliderFloat((std::string("Time##") + name).c_str(), &newState.time, min_time, max_time)) {
         //
     }
@@ -137,6 +230,7 @@ void Conv::drawGui() {
     }
     if (ImGui::Button("Reset")) {
         output.hide();
+        level = LEVEL_UNKNOWN;
     }
     // ImGui::Text("Output layers");
     // for (int i = 0; i < output.depth; i++) {
@@ -145,29 +239,55 @@ void Conv::drawGui() {
 }
 
 void Conv::init() {
-    int i = 0;
-    for (Filter *filter : filters) {
-        filterProps = {
-            .prts_per_size = PRTS_PER_SIZE,
-            .src = input.getRange(filter_x, filter_x + active_filter->width - 1, filter_y, filter_y + active_filter->height - 1),
-            .dst = output.getRange(filter_x, filter_x, filter_y, filter_y)[i]
-        };
-        filter->init(filterProps, TIME_OFFSET);
-        filter->hide_layer(-1);
-        i++;
+    window_cache.clear();
+    for (int i = 0; i < filters.size(); i++) {
+        filters[i]->init(getWindow(i, filter_x, filter_y));
+        filters[i]->hide_layer(-1);
     }
+    for (Filter *filter : sweep_filters) filter->release();
     if (state.is_visible) filters[filter_idx]->show_layer(-1);
 }
 
 void Conv::setupSequencer(VRaF::Sequencer &sequencer) {
     sequencer.track(name + ": Time", &newState.time);
 
-    sequencer.track(name + ": X", &newState.pos.x);
-    sequencer.track(name + ": Y", &newState.pos.y);
+    track_x = sequencer.track(name + ": X", &newState.pos.x);
+    track_y = sequencer.track(name + ": Y", &newState.pos.y);
+    sequencer.track(name + ": Sweep", &newState.sweep);
+}
+
+void Conv::prefetch(VRaF::Sequencer &sequencer) {
+    // Prepares the windows the sequencer is about to visit, a few per frame
+    int n_prepared = 0;
+    for (int frame = sequencer.getFrame() + 1; frame <= sequencer.getFrame() + PREFETCH_FRAMES; frame++) {
+        float x, y;
+        if (!sequencer.peek(track_x, frame, x) || !sequencer.peek(track_y, frame, y)) break;
+        if ((int)x == filter_x && (int)y == filter_y) continue;
+
+        for (int window = 0; window < getSweep(); window++) {
+            int sweep_x, sweep_y;
+            if (!getSweepPos((int)x, (int)y, window, sweep_x, sweep_y)) break;
+            if (window_cache.contains({filter_idx, sweep_x, sweep_y, getSweep()})) continue;
+
+            try {
+                getWindow(filter_idx, sweep_x, sweep_y);
+            } catch (std::runtime_error &e) {
+                // The outputs may be mid-transition; the window will be prepared when visited
+                return;
+            }
+            if (++n_prepared >= PREFETCH_WINDOWS) return;
+        }
+    }
 }
 
 bool Conv::update() {
     bool result = false;
+    if (newState.sweep != state.sweep) {
+        state.sweep = newState.sweep;
+        initSweep();
+        renderer.resetFrame();
+        result = true;
+    }
     if(newState.pos != state.pos) {
         if ((int)newState.pos.x != filter_x || (int)newState.pos.y != filter_y) {
             filter_x = (int)newState.pos.x;
@@ -175,11 +295,8 @@ bool Conv::update() {
 
             std::cout << "Conv update: " << filter_x << ' ' << filter_y << std::endl;
 
-            filterProps.src = input.getRange(filter_x * stride, filter_x * stride + 
-                active_filter->width - 1, filter_y * stride, filter_y * stride + active_filter->height - 1);
-
-            filterProps.dst = output.getRange(filter_x, filter_x, filter_y, filter_y)[0];
-            active_filter->init(filterProps, TIME_OFFSET);
+            active_filter->init(getWindow(filter_idx, filter_x, filter_y));
+            initSweep();
             renderer.resetFrame();
         }
         state.pos = newState.pos;
@@ -189,11 +306,11 @@ bool Conv::update() {
         // is_visible = should_be_visible;
         if (newState.is_visible) {
             std::cout << "Showing layer " << name << std::endl;
-            active_filter->show_layer(-1);
+            for (Filter *filter : getActiveFilters()) filter->show_layer(-1);
         }
         else {
             std::cout << "Hiding layer " << name << std::endl;
-            active_filter->hide_layer(-1);
+            for (Filter *filter : getActiveFilters()) filter->hide_layer(-1);
         }
 
         state.is_visible = newState.is_visible;
@@ -203,10 +320,10 @@ bool Conv::update() {
         for (int i = 0; i < newState.inputsVisible.size(); i++) {
             if (newState.inputsVisible[i]) {
                 input.show_layer(i);
-                if (state.is_visible) active_filter->show_layer(i);
+                if (state.is_visible) for (Filter *filter : getActiveFilters()) filter->show_layer(i);
             } else {
                 input.hide_layer(i);
-                if (state.is_visible) active_filter->hide_layer(i);
+                if (state.is_visible) for (Filter *filter : getActiveFilters()) filter->hide_layer(i);
             }
         }
         state.inputsVisible = newState.inputsVisible;
@@ -214,7 +331,8 @@ bool Conv::update() {
     }
     if (newState.time != state.time) {
         state.time = newState.time;
-        active_filter->setStage(state.time);
+        // All the sweep windows run the same stage
+        for (Filter *filter : getActiveFilters()) filter->setStage(state.time);
         renderer.resetFrame();
         result = true;
     }
@@ -223,12 +341,118 @@ bool Conv::update() {
     return result;
 }
 
-void Conv::setWeights(std::vector<unsigned long> weights_shape, std::vector<double> weights_data, std::vector<float> bias) {
+void Conv::setWeights(std::vector<unsigned long> weights_shape, std::vector<double> weights_data, std::vector<float> bias, int groups) {
     for (int layer = 0; layer < output.depth; layer++) {
-        filters.push_back(new Filter(renderer, weights_shape, weights_data, bias[layer], layer));
+        filters.push_back(new Filter(renderer, weights_shape, weights_data, bias[layer], layer, groups));
     }
     if (filters.size() == 0) throw std::runtime_error("Filters are empty");
+    window_cache.clear();
     active_filter = filters[filter_idx];
+    make_sweep_filter = [this, weights_shape, weights_data, bias, groups]() {
+        return new Filter(this->renderer, weights_shape, weights_data, bias[0], 0, groups);
+    };
+}
+
+void Conv::allocateSweep() {
+    if (!sweep_filters.empty()) return;
+    for (int i = 1; i < SWEEP_WINDOWS; i++) sweep_filters.push_back(make_sweep_filter());
+    // Their instances join the TLAS, which is built anew for them
+    renderer.appendInstances();
+    for (Filter *filter : sweep_filters) filter->release();
+}
+
+void Conv::initSweep() {
+    if (getSweep() > 1) allocateSweep();
+    // The sweep windows continue the raster scan from the active one
+    for (int i = 0; i < sweep_filters.size(); i++) {
+        Filter *filter = sweep_filters[i];
+        int x, y;
+        if (i + 1 < getSweep() && getSweepPos(filter_x, filter_y, i + 1, x, y)) {
+            bool is_shown = filter->window != nullptr;
+            filter->copyWeights(*active_filter);
+            filter->init(getWindow(filter_idx, x, y));
+            if (!is_shown && state.is_visible) filter->show_layer(-1);
+        } else if (filter->window) {
+            filter->release();
+        }
+    }
+}
+
+std::vector<Filter*> Conv::getActiveFilters() {
+    std::vector<Filter*> result = {active_filter};
+    for (Filter *filter : sweep_filters) {
+        if (filter->window) result.push_back(filter);
+    }
+    return result;
+}
+
+bool Conv::getSweepPos(int x, int y, int window, int &sweep_x, int &sweep_y) {
+    int n_x = (input.width - active_filter->width) / stride + 1;
+    int n_y = (input.height - active_filter->height) / stride + 1;
+    int pos = x * n_y + y + window;
+    if (pos >= n_x * n_y) return false;
+    sweep_x = pos / n_y;
+    sweep_y = pos % n_y;
+    return true;
+}
+
+FilterProps Conv::getWindowProps(int filter_idx, int x, int y) {
+    Filter *filter = filters[filter_idx];
+    return {
+        // The particle budget is shared by all the sweep windows
+        .prts_per_size = (float)PRTS_PER_SIZE / getSweep(),
+        .src = input.getWindow(x, y, filter->width, filter->height, stride),
+        .dst = output.getItem(filter_idx, x, y)
+    };
+}
+
+FilterProps Conv::slideWindowProps(int filter_idx, int x, int y, const FilterWindow &from, int from_x, int from_y) {
+    // Items overlapping with the neighbouring window are taken from it; only the entering ones are looked up
+    Filter *filter = filters[filter_idx];
+    // A window over the edge would be cropped by getWindowProps, and rejected by the filter
+    if (x < 0 || y < 0 || x >= output.width || y >= output.height ||
+            x * stride + filter->width > input.width || y * stride + filter->height > input.height) {
+        throw std::runtime_error("Data slice and filter sizes does not match");
+    }
+    FilterProps props = from.props;
+    props.dst = output.getItem(filter_idx, x, y);
+    int dx = (x - from_x) * stride;
+    int dy = (y - from_y) * stride;
+    int depth = filter->window_size / (filter->width * filter->height);
+    for (int c = 0; c < depth; c++) {
+        for (int kx = 0; kx < filter->width; kx++) {
+            for (int ky = 0; ky < filter->height; ky++) {
+                int from_kx = kx + dx;
+                int from_ky = ky + dy;
+                int idx = (c * filter->width + kx) * filter->height + ky;
+                if (from_kx >= 0 && from_kx < filter->width && from_ky >= 0 && from_ky < filter->height) {
+                    props.src[idx] = from.props.src[(c * filter->width + from_kx) * filter->height + from_ky];
+                } else {
+                    props.src[idx] = input.getItem(c, x * stride + kx, y * stride + ky);
+                }
+            }
+        }
+    }
+    return props;
+}
+
+std::shared_ptr<FilterWindow> Conv::getWindow(int filter_idx, int x, int y) {
+    WindowKey key = {filter_idx, x, y, getSweep()};
+    std::shared_ptr<FilterWindow> window = window_cache.get(key);
+    if (window) return window;
+
+    // A neighbouring window (raster scans always have the previous one) is slid instead of built anew
+    const int neighbours[4][2] = {{x - 1, y}, {x, y - 1}, {x + 1, y}, {x, y + 1}};
+    for (auto &n : neighbours) {
+        std::shared_ptr<FilterWindow> from = window_cache.get({filter_idx, n[0], n[1], getSweep()});
+        if (!from || from->props.src.size() != filters[filter_idx]->window_size) continue;
+
+        window = filters[filter_idx]->prepare(slideWindowProps(filter_idx, x, y, *from, n[0], n[1]), TIME_OFFSET);
+        break;
+    }
+    if (!window) window = filters[filter_idx]->prepare(getWindowProps(filter_idx, x, y), TIME_OFFSET);
+    window_cache.put(key, window);
+    return window;
 }
 
 float Conv::getMaxTime() {
@@ -239,28 +463,18 @@ float Conv::getMinTime() {
     return min_time;
 }
 
+int Conv::getSweep() {
+    return std::max(1, std::min(SWEEP_WINDOWS, (int)state.sweep));
+}
+
 AvgPool::AvgPool(std::string name, Renderer &renderer, Data &input, Data &output, int stride) : Conv(name, renderer, input, output, stride) {
     if (input.depth != output.depth) {
         throw std::runtime_error("For pooling layer, input and output depths must match.");
     }
-    std::vector<unsigned long> weights_shape = {(unsigned long)output.depth, (unsigned long)input.depth, (unsigned long)stride, (unsigned long)stride};
-    std::vector<double> weights_data(output.depth * input.depth * stride * stride, 0);
-    for (int i = 0; i < weights_data.size(); i++) {
-        int layer_out = i / (input.depth * stride * stride);
-        int i_in = i - layer_out * input.depth * stride * stride;
-        int layer_in  = i_in / (stride * stride);
-        if (layer_in == layer_out) weights_data[i] = 1.0 / stride / stride;
-    }
-    setWeights(weights_shape, weights_data, std::vector<float>(output.depth, 0));
-}
-
-void AvgPool::init() {
-    Conv::init();
-    for (int f = 0; f < filters.size(); f++) {
-        for (int l = 0; l < output.depth; l++) {
-            if (f != l) filters[f]->hide_layer(l);
-        }
-    }
+    // Depthwise: every output channel averages its own input channel only
+    std::vector<unsigned long> weights_shape = {(unsigned long)output.depth, 1, (unsigned long)stride, (unsigned long)stride};
+    std::vector<double> weights_data(output.depth * stride * stride, 1.0 / stride / stride);
+    setWeights(weights_shape, weights_data, std::vector<float>(output.depth, 0), input.depth);
 }
 
 Transition::Transition(std::string name, Renderer &renderer, Data &input, Data &output) : Layer(name, renderer, input, output) {
@@ -310,6 +524,7 @@ bool Transition::update() {
     state.inputsVisible = newState.inputsVisible;
     state.is_visible = newState.is_visible;
     state.pos = newState.pos;
+    state.sweep = newState.sweep;
 
     if (newState != state) throw std::runtime_error("Not all updates were handled");
     return result;
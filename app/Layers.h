@@ -5,25 +5,45 @@
 #include "vraf.h"
 #include "Renderer.h"
 #include "DataItem.h"
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+// Window cache constraints
+#define WINDOW_CACHE_SIZE 256
+#define PREFETCH_FRAMES 2 * FRAMES_PER_CONV_STEP
+#define PREFETCH_WINDOWS 2
+
+// Maximal number of windows animated at once in the sweep mode
+#define SWEEP_WINDOWS 4
 
 class Layer;
 class Conv;
 class Transition;
 class AvgPool;
 
+// Where a layer was put last. Lets the cascade skip layers that are already there
+enum LayerLevel {
+    LEVEL_UNKNOWN,
+    LEVEL_MIN,
+    LEVEL_MAX,
+    LEVEL_ACTIVE
+};
+
 class LayerState
 {
 public:
     vec3 pos;
     float time = 0;
+    float sweep = 1;                // Number of windows animated at once
     bool is_visible;
     std::vector<bool> inputsVisible;
     bool operator==(const LayerState other) const {
-        return pos == other.pos &&
+        return pos == other.pos && sweep == other.sweep &&
             time == other.time && is_visible == other.is_visible && inputsVisible == other.inputsVisible;
     }
     bool operator!=(const LayerState other) const {
-        return pos != other.pos ||
+        return pos != other.pos || sweep != other.sweep ||
             time != other.time || is_visible != other.is_visible || inputsVisible != other.inputsVisible;
     }
 };
@@ -41,11 +61,23 @@ public:
     Data& output;
     LayerState state;
     LayerState newState;
+    LayerLevel level = LEVEL_UNKNOWN;
+    std::vector<Layer*> upstream;       // Layers producing the input
+    std::vector<Layer*> downstream;     // Layers consuming the output
 
     Layer(std::string name, Renderer &renderer, Data &input, Data &output);
+    // Builds the dependency graph, layers are connected through their Data
+    static void link(std::vector<Layer*> &layers);
+    // All the layers this one depends on, producers first
+    std::vector<Layer*> getUpstream();
+    // All the layers depending on this one, consumers last
+    std::vector<Layer*> getDownstream();
     virtual void drawGui();
     virtual void init();
     virtual void setupSequencer(VRaF::Sequencer &sequencer);
+    virtual void prefetch(VRaF::Sequencer &sequencer);
+    // Creates the instances shown in the sweep mode, if the layer has any. Once done, they're kept
+    virtual void allocateSweep();
     virtual bool update();
     virtual void toMax();
     virtual void toMin();
@@ -54,6 +86,43 @@ public:
     virtual int getWidth();
     virtual int getHeight();
     virtual int getDepth();
+    virtual int getSweep();
+};
+
+// Windows are cached per layer, the key only tells them apart within it
+struct WindowKey {
+    int filter_idx, x, y;
+    int sweep;                      // Particle density depends on the number of windows shown
+    bool operator==(const WindowKey &other) const {
+        return filter_idx == other.filter_idx && x == other.x && y == other.y && sweep == other.sweep;
+    }
+};
+
+struct WindowKeyHash {
+    size_t operator()(const WindowKey &key) const {
+        size_t result = key.filter_idx;
+        result = result * 31 + key.x;
+        result = result * 31 + key.y;
+        result = result * 31 + key.sweep;
+        return result;
+    }
+};
+
+// Bounded cache of prepared windows. The least recently used one is dropped first
+class WindowCache
+{
+public:
+    WindowCache(size_t capacity);
+    std::shared_ptr<FilterWindow> get(const WindowKey &key);
+    void put(const WindowKey &key, std::shared_ptr<FilterWindow> window);
+    bool contains(const WindowKey &key) const;
+    void clear();
+
+private:
+    size_t capacity;
+    // Most recently used first
+    std::list<std::pair<WindowKey, std::shared_ptr<FilterWindow>>> entries;
+    std::unordered_map<WindowKey, std::list<std::pair<WindowKey, std::shared_ptr<FilterWindow>>>::iterator, WindowKeyHash> index;
 };
 
 class Conv : public Layer
@@ -63,23 +132,37 @@ public:
     // bool is_visible = true; // , should_be_visible = false;
     std::vector<Filter*> filters;
     Filter *active_filter;
+    // Windows following the active one in the sweep mode. Allocated the first time the sweep is on
+    std::vector<Filter*> sweep_filters;
+    std::function<Filter*()> make_sweep_filter;
     int filter_idx = 0;
     int stride;
     // float filter_x_f, filter_y_f;
-    FilterProps filterProps;
     const float max_time = 5;
+    // Built from the input and the weights, emptied when either is set
+    WindowCache window_cache{WINDOW_CACHE_SIZE};
+    VRaF::TrackHandle track_x, track_y;
     // bool is_pos_updated = false;
 
     Conv(std::string name, Renderer &renderer, Data &input, Data &output, std::string weights_path, int stride=1);
     Conv(std::string name, Renderer &renderer, Data &input, Data &output, int stride=1);
     void _Conv();
-    void setWeights(std::vector<unsigned long> weights_shape, std::vector<double> weights_data, std::vector<float> bias);
+    void setWeights(std::vector<unsigned long> weights_shape, std::vector<double> weights_data, std::vector<float> bias, int groups = 1);
+    void initSweep();
+    virtual void allocateSweep() override;
+    std::vector<Filter*> getActiveFilters();
+    bool getSweepPos(int x, int y, int window, int &sweep_x, int &sweep_y);
+    FilterProps getWindowProps(int filter_idx, int x, int y);
+    FilterProps slideWindowProps(int filter_idx, int x, int y, const FilterWindow &from, int from_x, int from_y);
+    std::shared_ptr<FilterWindow> getWindow(int filter_idx, int x, int y);
     virtual void drawGui() override;
     virtual void init() override;
     virtual void setupSequencer(VRaF::Sequencer &sequencer) override;
+    virtual void prefetch(VRaF::Sequencer &sequencer) override;
     virtual bool update() override;
     virtual float getMaxTime();
     virtual float getMinTime();
+    virtual int getSweep() override;
 };
                                         
 class Transition : public Layer
@@ -101,7 +184,6 @@ class AvgPool : public Conv
 {
 public:
     AvgPool(std::string name, Renderer &renderer, Data &input, Data &output, int stride);
-    virtual void init() override;
 };
 
 #endif
@@ -0,0 +1,128 @@
+#include "OutputSink.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include "stb_image_write.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#define POPEN_MODE "wb"
+#else
+#include <sys/wait.h>
+#define POPEN_MODE "w"
+#endif
+
+const char* output_format_names[OUTPUT_COUNT] = { "PNG files", "Y4M stream", "Raw RGB stream" };
+
+namespace fs = std::filesystem;
+
+void PngSink::write(const std::string &name, int width, int height, const uint8_t *rgba, std::string &frame) {
+    // The old file may be linked to other frames; writing over it would change them too
+    std::error_code error;
+    fs::remove(name, error);
+    if (!stbi_write_png(name.c_str(), width, height, 4, rgba, 0)) {
+        std::cout << "Failed to write " << name << std::endl;
+    }
+}
+
+void PngSink::repeat(const std::string &previous, const std::string &name) {
+    std::error_code error;
+    fs::remove(name, error);
+    fs::create_hard_link(previous, name, error);
+    if (error) fs::copy_file(previous, name, fs::copy_options::overwrite_existing, error);
+    if (error) std::cout << "Failed to write " << name << ": " << error.message() << std::endl;
+}
+
+StreamSink::StreamSink(const std::string &target, OutputFormat format, int fps) : format(format), fps(fps) {
+    is_pipe = !target.empty() && target[0] == '|';
+    if (is_pipe) {
+#ifndef _WIN32
+        // A command that exits early would kill the app on the next write; the write fails instead
+        std::signal(SIGPIPE, SIG_IGN);
+#endif
+        stream = popen(target.c_str() + 1, POPEN_MODE);
+    } else {
+        stream = std::fopen(target.c_str(), "wb");
+    }
+    if (!stream) throw std::runtime_error("Can't open the output " + target);
+}
+
+StreamSink::~StreamSink() {
+    if (is_pipe) {
+        // Waits for the command to finish
+        int status = pclose(stream);
+#ifndef _WIN32
+        if (status != -1 && WIFEXITED(status)) status = WEXITSTATUS(status);
+#endif
+        if (status != 0) std::cout << "Output command failed, status " << status << std::endl;
+    } else if (std::fclose(stream) != 0) {
+        std::cout << "Failed to close the output: " << std::strerror(errno) << std::endl;
+    }
+}
+
+void StreamSink::prepare(int width, int height, const uint8_t *rgba, std::string &frame) const {
+    const int n_pixels = width * height;
+    frame.resize(n_pixels * 3);
+    if (format == OUTPUT_Y4M) {
+        // BT.601, limited range; a plane after the other
+        uint8_t *y = (uint8_t*)&frame[0], *u = y + n_pixels, *v = u + n_pixels;
+        for (int i = 0; i < n_pixels; i++) {
+            int r = rgba[4 * i], g = rgba[4 * i + 1], b = rgba[4 * i + 2];
+            y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            u[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            v[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+    } else {
+        uint8_t *rgb = (uint8_t*)&frame[0];
+        for (int i = 0; i < n_pixels; i++) {
+            rgb[3 * i] = rgba[4 * i];
+            rgb[3 * i + 1] = rgba[4 * i + 1];
+            rgb[3 * i + 2] = rgba[4 * i + 2];
+        }
+    }
+}
+
+void StreamSink::write(const std::string &name, int width, int height, const uint8_t *rgba, std::string &frame) {
+    if (this->width == 0) {
+        this->width = width;
+        this->height = height;
+        if (format == OUTPUT_Y4M) {
+            std::fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+        }
+    }
+    if (width != this->width || height != this->height) {
+        std::cout << "Frame " << name << " is " << width << "x" << height << ", the stream is "
+                  << this->width << "x" << this->height << "; skipped" << std::endl;
+        return;
+    }
+    put(name, frame);
+    // Kept for repeats; the encoder gets the old buffer back to convert into
+    last.swap(frame);
+}
+
+void StreamSink::repeat(const std::string &previous, const std::string &name) {
+    if (width == 0) {
+        std::cout << "Frame " << name << " repeats " << previous << ", which wasn't written; skipped" << std::endl;
+        return;
+    }
+    put(name, last);
+}
+
+void StreamSink::put(const std::string &name, const std::string &frame) {
+    if (is_broken) return;
+    if (format == OUTPUT_Y4M) std::fputs("FRAME\n", stream);
+    if (std::fwrite(frame.data(), 1, frame.size(), stream) != frame.size() || std::ferror(stream)) {
+        std::cout << "Failed to write frame " << name << " to the stream: " << std::strerror(errno)
+                  << "; the following frames are dropped" << std::endl;
+        is_broken = true;
+    }
+}
+
+std::unique_ptr<OutputSink> createOutputSink(OutputFormat format, const std::string &target, int fps) {
+    if (format == OUTPUT_PNG) return std::make_unique<PngSink>();
+    return std::make_unique<StreamSink>(target, format, fps);
+}
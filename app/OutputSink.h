@@ -0,0 +1,72 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+enum OutputFormat {
+    OUTPUT_PNG,         // A file per frame
+    OUTPUT_Y4M,         // YUV 4:4:4 stream
+    OUTPUT_RAW,         // Headerless RGB24 stream
+
+    OUTPUT_COUNT
+};
+extern const char* output_format_names[OUTPUT_COUNT];
+
+// Where the encoder puts the saved images. Pixels are RGBA8, the top row first
+class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+    // Converts the pixels into what write takes. Runs on any encoder thread, in any order
+    virtual void prepare(int width, int height, const uint8_t *rgba, std::string &frame) const {}
+    // The frame is what prepare made of the pixels; the sink may take it over
+    virtual void write(const std::string &name, int width, int height, const uint8_t *rgba, std::string &frame) = 0;
+    // The frame written as previous, again under the name
+    virtual void repeat(const std::string &previous, const std::string &name) = 0;
+    // If true, the frames are written one at a time, in the order they were saved
+    virtual bool isOrdered() const { return false; }
+};
+
+// Compressed PNG at the name of the frame
+class PngSink : public OutputSink {
+public:
+    void write(const std::string &name, int width, int height, const uint8_t *rgba, std::string &frame) override;
+    // A hard link to the previous file, a copy where links aren't supported
+    void repeat(const std::string &previous, const std::string &name) override;
+};
+
+// Every frame appended to one stream, the name is ignored. The target is a file path,
+// or a command to pipe the frames to when it starts with '|'. For example, the raw format goes with
+//   |ffmpeg -y -f rawvideo -pix_fmt rgb24 -s 1280x720 -r 30 -i - out.mp4
+// and Y4M with
+//   |ffmpeg -y -i - out.mp4
+class StreamSink : public OutputSink {
+public:
+    StreamSink(const std::string &target, OutputFormat format, int fps);
+    ~StreamSink();
+    // To YUV or RGB24
+    void prepare(int width, int height, const uint8_t *rgba, std::string &frame) const override;
+    void write(const std::string &name, int width, int height, const uint8_t *rgba, std::string &frame) override;
+    // The last frame written, whatever the previous name
+    void repeat(const std::string &previous, const std::string &name) override;
+    bool isOrdered() const override { return true; }
+
+private:
+    std::FILE *stream;
+    bool is_pipe;
+    OutputFormat format;
+    int fps;
+    int width = 0;          // Of the first frame; the stream can't change it
+    int height = 0;
+    std::string last;       // The last frame written
+    bool is_broken = false; // A write failed, the stream takes no more
+
+    void put(const std::string &name, const std::string &frame);
+};
+
+// PNG when the format is OUTPUT_PNG, a stream to the target otherwise
+std::unique_ptr<OutputSink> createOutputSink(OutputFormat format, const std::string &target, int fps);
+
+#endif
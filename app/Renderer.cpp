@@ -47,11 +47,19 @@ extern std::vector<std::string> defaultSearchPaths;
 
 void Renderer::prepareFrame()
 {
-  if (is_rebuild_tlas) m_rtBuilder.buildTlas(m_tlas, m_rtFlags, true);
+  if (m_tlas.size() != m_tlasInstanceCount) rebuildTopLevelAS(m_tlas);
+  else if (is_rebuild_tlas) m_rtBuilder.buildTlas(m_tlas, m_rtFlags, true);
   is_rebuild_tlas = false;
   nvvkhl::AppBaseVk::prepareFrame();
 }
 
+void Renderer::prepareFrame(const std::vector<VkAccelerationStructureInstanceKHR>* tlas)
+{
+  if (tlas && tlas->size() != m_tlasInstanceCount) rebuildTopLevelAS(*tlas);
+  else if (tlas) m_rtBuilder.buildTlas(*tlas, m_rtFlags, true);
+  nvvkhl::AppBaseVk::prepareFrame();
+}
+
 //--------------------------------------------------------------------------------------------------
 // Keep the handle on the device
 // Initialize the tool to do all our allocations: buffers, images
@@ -64,6 +72,8 @@ void Renderer::setup(const VkInstance& instance, const VkDevice& device, const V
   m_debug.setup(m_device);
   m_offscreenDepthFormat = nvvk::findDepthFormat(physicalDevice);
   is_rebuild_tlas = false;
+  createReadbacks();
+  createConvergence();
 }
 
 void Renderer::loadModels(uint32_t nParticles) {
@@ -366,6 +376,13 @@ void Renderer::createObjDescriptionBuffer()
 //
 void Renderer::destroyResources()
 {
+  destroyReadbacks();
+  destroyConvergence();
+  m_alloc.destroy(m_bThresholds);
+  vkDestroyPipeline(m_device, m_quantizePipeline, nullptr);
+  vkDestroyPipelineLayout(m_device, m_quantizePipelineLayout, nullptr);
+  vkDestroyDescriptorPool(m_device, m_quantizeDescPool, nullptr);
+  vkDestroyDescriptorSetLayout(m_device, m_quantizeDescSetLayout, nullptr);
   m_alloc.destroy(m_bGlobals);
   m_alloc.destroy(m_bObjDesc);
 
@@ -410,6 +427,7 @@ void Renderer::onResize(int /*w*/, int /*h*/)
   createOffscreenRender();
   updatePostDescriptorSet();
   updateRtDescriptorSet();
+  updateQuantizeDescriptorSet();
 }
 
 void Renderer::onMouseMotion(int x, int y)
@@ -501,6 +519,7 @@ void Renderer::createOffscreenRender()
 {
   m_alloc.destroy(m_offscreenColor);
   m_alloc.destroy(m_offscreenDepth);
+  m_alloc.destroy(m_bVariances);
 
   // Creating the color image
   {
@@ -515,6 +534,11 @@ void Renderer::createOffscreenRender()
     m_offscreenColor.descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
   }
 
+  // Variances of the color image pixels; the first pass of the accumulation writes them
+  m_bVariances = m_alloc.createBuffer(sizeof(float) * m_size.width * m_size.height,
+                                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
   // Creating the depth buffer
   auto depthCreateInfo = nvvk::makeImage2DCreateInfo(m_size, m_offscreenDepthFormat, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
   {
@@ -728,6 +752,40 @@ void Renderer::createTopLevelAS()
   }
   m_rtFlags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
   m_rtBuilder.buildTlas(m_tlas, m_rtFlags);
+  m_tlasInstanceCount = m_tlas.size();
+}
+
+void Renderer::appendInstances()
+{
+  for(size_t i = m_tlas.size(); i < m_instances.size(); i++)
+  {
+    const Renderer::ObjInstance&       inst = m_instances[i];
+    VkAccelerationStructureInstanceKHR rayInst{};
+    rayInst.transform                      = nvvk::toTransformMatrixKHR(nvmath::scale_mat4(nvmath::vec3f(0.0f)));
+    rayInst.instanceCustomIndex            = inst.objIndex;
+    rayInst.accelerationStructureReference = m_rtBuilder.getBlasDeviceAddress(inst.objIndex);
+    rayInst.flags                          = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+    rayInst.mask                           = 0xFF;
+    rayInst.instanceShaderBindingTableRecordOffset = inst.hitgroup;
+    m_tlas.emplace_back(rayInst);
+  }
+}
+
+void Renderer::rebuildTopLevelAS(const std::vector<VkAccelerationStructureInstanceKHR>& instances)
+{
+  // The TLAS may be in use by the frames in flight
+  vkDeviceWaitIdle(m_device);
+  m_rtBuilder.destroyTlas();
+  m_rtBuilder.buildTlas(instances, m_rtFlags);
+  m_tlasInstanceCount = instances.size();
+
+  VkAccelerationStructureKHR                   tlas = m_rtBuilder.getAccelerationStructure();
+  VkWriteDescriptorSetAccelerationStructureKHR descASInfo{VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR};
+  descASInfo.accelerationStructureCount = 1;
+  descASInfo.pAccelerationStructures    = &tlas;
+  VkWriteDescriptorSet wds = m_rtDescSetLayoutBind.makeWrite(m_rtDescSet, RtxBindings::eTlas, &descASInfo);
+  vkUpdateDescriptorSets(m_device, 1, &wds, 0, nullptr);
+  resetFrame();
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -819,6 +877,18 @@ void Renderer::raytrace(const VkCommandBuffer& cmdBuf, const nvmath::vec4f& clea
 {
   m_debug.beginLabel(cmdBuf, "Ray trace");
 
+  // The pass counts its noisy pixels from zero, in a slot the host isn't reading anymore
+  int slot = m_passCount % CONVERGENCE_SLOTS;
+  vkCmdFillBuffer(cmdBuf, m_bNoisyCounts.buffer, slot * sizeof(uint32_t), sizeof(uint32_t), 0);
+  VkMemoryBarrier fillBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  fillBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  fillBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                       &fillBarrier, 0, nullptr, 0, nullptr);
+  m_pcRay.convergenceSlot    = slot;
+  m_pcRay.varianceAddress    = nvvk::getBufferDeviceAddress(m_device, m_bVariances.buffer);
+  m_pcRay.convergenceAddress = nvvk::getBufferDeviceAddress(m_device, m_bNoisyCounts.buffer);
+
   m_pcRay.maxDepth = 64;               // How deep the path is
   m_pcRay.maxSamples = 80;             // How many samples to do per render
   m_pcRay.fireflyClampThreshold = 1.0;  // to cut fireflies
@@ -840,8 +910,16 @@ void Renderer::raytrace(const VkCommandBuffer& cmdBuf, const nvmath::vec4f& clea
 
   vkCmdDispatch(cmdBuf, (m_size.width + (GROUP_SIZE - 1)) / GROUP_SIZE, (m_size.height + (GROUP_SIZE - 1)) / GROUP_SIZE, 1);
 
+  // The count goes to the host
+  VkMemoryBarrier countBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  countBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  countBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &countBarrier,
+                       0, nullptr, 0, nullptr);
+
   m_debug.endLabel(cmdBuf);
 
+  m_passCount++;
   updateFrame();
 }
 
@@ -863,19 +941,45 @@ void Renderer::updateFrame()
     refCamMatrix = m;
     refFov       = fov;
   }
+  if (is_reset_frame.exchange(false)) m_pcRay.frame = -1;
   m_pcRay.frame++;
 }
 
 void Renderer::resetFrame()
 {
-  m_pcRay.frame = -1;
+  is_reset_frame = true;
 }
 
-void Renderer::imageToBuffer(const nvvk::Texture& imgIn, const VkBuffer& pixelBufferOut)
+// FNV-1a
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
 {
-  nvvk::CommandPool genCmdBuf(m_device, m_graphicsQueueIndex);
-  VkCommandBuffer cmdBuff = genCmdBuf.createCommandBuffer();
+  const uint8_t* bytes = (const uint8_t*)data;
+  for(size_t i = 0; i < size; i++)
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  return hash;
+}
 
+uint64_t Renderer::hashSceneState() const
+{
+  // Without what changes every pass
+  PushConstantRay settings    = m_pcRay;
+  settings.frame              = 0;
+  settings.convergenceSlot    = 0;
+  settings.varianceAddress    = 0;
+  settings.convergenceAddress = 0;
+
+  uint64_t hash = 0xcbf29ce484222325ull;
+  hash          = hashBytes(hash, m_tlas.data(), m_tlas.size() * sizeof(VkAccelerationStructureInstanceKHR));
+  hash          = hashBytes(hash, &camera.pos, sizeof(camera.pos));
+  hash          = hashBytes(hash, &camera.tgt, sizeof(camera.tgt));
+  hash          = hashBytes(hash, &camera.fov, sizeof(camera.fov));
+  hash          = hashBytes(hash, &m_size, sizeof(m_size));
+  hash          = hashBytes(hash, &settings, sizeof(settings));
+  return hash;
+}
+
+void Renderer::imageToBuffer(const VkCommandBuffer& cmdBuff, const nvvk::Texture& imgIn, const VkBuffer& pixelBufferOut)
+{
   VkImageSubresourceRange subresourceRange;
   subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
   subresourceRange.levelCount     = 1;
@@ -900,39 +1004,291 @@ void Renderer::imageToBuffer(const nvvk::Texture& imgIn, const VkBuffer& pixelBu
                             &copyRegion );
 
   nvvk::cmdBarrierImageLayout(cmdBuff, imgIn.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, subresourceRange);
-  genCmdBuf.submitAndWait(cmdBuff);
 }
 
 //--------------------------------------------------------------------------------------------------
-// Save the image to disk
+// Saved images go through a ring of staging buffers. The copy is submitted with a fence,
+// and the image is written once it signals; the CPU only waits when the ring is full
 //
-void Renderer::saveImage(const std::string& outFilename)
-{
-  // Create a temporary buffer to hold the pixels of the image
-  VkBufferUsageFlags usage{VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT};
-  VkDeviceSize       bufferSize = 4 * sizeof(float) * m_size.width * m_size.height;
-  nvvk::Buffer pixelBuffer        = m_alloc.createBuffer(bufferSize, usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-
-  imageToBuffer(m_offscreenColor, pixelBuffer.buffer);
-
-  // Write the buffer to disk
-  const void* data_float = m_alloc.map(pixelBuffer);
-  std::vector<uint8_t> data(m_size.width * m_size.height * 4);
-  for (int i = 0; i < data.size(); i++) {
-    float val = ((float*)data_float)[i];
-    // Emulate post shader
-    val = pow(val, 1 / 2.2);
-
-    val *= 255;
-    if (val > 255) val = 255;
-    if (val < 0) val = 0;
-    data[i] = (uint8_t)val;
+//--------------------------------------------------------------------------------------------------
+// Convergence of the accumulation
+//
+void Renderer::createConvergence()
+{
+  m_bNoisyCounts = m_alloc.createBuffer(sizeof(uint32_t) * CONVERGENCE_SLOTS,
+                                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+                                            | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  m_noisyCounts = (const uint32_t*)m_alloc.map(m_bNoisyCounts);
+
+  VkFenceCreateInfo fenceInfo{VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+  for(int i = 0; i < CONVERGENCE_SLOTS; i++)
+  {
+    vkCreateFence(m_device, &fenceInfo, nullptr, &m_passFences[i]);
+    m_markedPasses[i] = -1;
   }
-  stbi_write_png(outFilename.c_str(), m_size.width, m_size.height, 4, data.data(), 0);
-  m_alloc.unmap(pixelBuffer);
+}
 
-  // Destroy temporary buffer
-  m_alloc.destroy(pixelBuffer);
+void Renderer::destroyConvergence()
+{
+  vkDeviceWaitIdle(m_device);
+  for(VkFence& fence : m_passFences)
+  {
+    vkDestroyFence(m_device, fence, nullptr);
+    fence = VK_NULL_HANDLE;
+  }
+  m_alloc.unmap(m_bNoisyCounts);
+  m_alloc.destroy(m_bNoisyCounts);
+  m_alloc.destroy(m_bVariances);
+  m_noisyCounts = nullptr;
+}
+
+void Renderer::markPass()
+{
+  int64_t pass = m_passCount - 1;
+  int     slot = pass % CONVERGENCE_SLOTS;
+  // A fence can't be reset while it's pending
+  if(m_markedPasses[slot] >= 0)
+    vkWaitForFences(m_device, 1, &m_passFences[slot], VK_TRUE, UINT64_MAX);
+  vkResetFences(m_device, 1, &m_passFences[slot]);
+  // No batches; the fence is signaled once everything submitted before is done
+  vkQueueSubmit(m_queue, 0, nullptr, m_passFences[slot]);
+  m_markedPasses[slot] = pass;
+}
+
+int Renderer::getNoisyPixels(int passesAgo)
+{
+  int64_t pass = m_passCount - passesAgo;
+  if(pass < 0 || passesAgo > CONVERGENCE_SLOTS)
+    return -1;
+  int slot = pass % CONVERGENCE_SLOTS;
+  if(m_markedPasses[slot] != pass)
+    return -1;
+  vkWaitForFences(m_device, 1, &m_passFences[slot], VK_TRUE, UINT64_MAX);
+  return (int)m_noisyCounts[slot];
+}
+
+bool Renderer::isConverged(int passesAgo)
+{
+  int noisy = getNoisyPixels(passesAgo);
+  return noisy >= 0 && noisy <= m_maxNoisyFraction * m_size.width * m_size.height;
+}
+
+void Renderer::createReadbacks()
+{
+  VkCommandPoolCreateInfo poolInfo{VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+  poolInfo.flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  poolInfo.queueFamilyIndex = m_graphicsQueueIndex;
+  vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_readbackPool);
+
+  VkCommandBufferAllocateInfo allocInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+  allocInfo.commandPool        = m_readbackPool;
+  allocInfo.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = 1;
+  VkFenceCreateInfo fenceInfo{VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+  for(Readback& readback : m_readbacks)
+  {
+    vkAllocateCommandBuffers(m_device, &allocInfo, &readback.cmdBuf);
+    vkCreateFence(m_device, &fenceInfo, nullptr, &readback.fence);
+  }
+}
+
+void Renderer::destroyReadbacks()
+{
+  processReadbacks(true);
+  for(Readback& readback : m_readbacks)
+  {
+    if(readback.size.width > 0)
+    {
+      m_alloc.unmap(readback.buffer);
+      m_alloc.destroy(readback.buffer);
+    }
+    vkDestroyFence(m_device, readback.fence, nullptr);
+    readback = {};
+  }
+  vkDestroyCommandPool(m_device, m_readbackPool, nullptr);
+  m_readbackPool = VK_NULL_HANDLE;
+}
+
+void Renderer::saveImage(const std::string& outFilename, OutputSink* sink)
+{
+  Readback& readback = m_readbacks[m_readbackNext];
+  m_readbackNext     = (m_readbackNext + 1) % READBACK_SLOTS;
+  // The ring is full, the oldest image goes first
+  if(readback.is_pending)
+  {
+    vkWaitForFences(m_device, 1, &readback.fence, VK_TRUE, UINT64_MAX);
+    writeReadback(readback);
+  }
+  if(readback.encoding)
+  {
+    m_encoder.wait(readback.encoding);
+    readback.encoding = 0;
+  }
+
+  // The buffers are only replaced when the size or the format changes
+  if(readback.size.width != m_size.width || readback.size.height != m_size.height || readback.is_quantized != m_isGpuQuantize)
+  {
+    if(readback.size.width > 0)
+    {
+      m_alloc.unmap(readback.buffer);
+      m_alloc.destroy(readback.buffer);
+    }
+    VkBufferUsageFlags usage{VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                             | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT};
+    VkDeviceSize pixelSize  = m_isGpuQuantize ? 4 * sizeof(uint8_t) : 4 * sizeof(float);
+    VkDeviceSize bufferSize = pixelSize * m_size.width * m_size.height;
+    readback.buffer       = m_alloc.createBuffer(bufferSize, usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    readback.pixels       = m_alloc.map(readback.buffer);
+    readback.size         = m_size;
+    readback.is_quantized = m_isGpuQuantize;
+  }
+
+  vkResetFences(m_device, 1, &readback.fence);
+  vkResetCommandBuffer(readback.cmdBuf, 0);
+  VkCommandBufferBeginInfo beginInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(readback.cmdBuf, &beginInfo);
+  if(readback.is_quantized)
+    quantizeToBuffer(readback.cmdBuf, readback.buffer);
+  else
+    imageToBuffer(readback.cmdBuf, m_offscreenColor, readback.buffer.buffer);
+  vkEndCommandBuffer(readback.cmdBuf);
+
+  VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers    = &readback.cmdBuf;
+  vkQueueSubmit(m_queue, 1, &submitInfo, readback.fence);
+  readback.filename   = outFilename;
+  readback.sink       = sink;
+  readback.is_pending = true;
+}
+
+void Renderer::processReadbacks(bool is_wait)
+{
+  queueReadbacks(is_wait);
+  if(is_wait)
+    m_encoder.wait();
+}
+
+void Renderer::repeatImage(const std::string& previousFilename, const std::string& outFilename, OutputSink* sink)
+{
+  // The previous image must be queued first; the encoder writes the repeat after it
+  queueReadbacks(true);
+  m_encoder.repeat(previousFilename, outFilename, sink);
+}
+
+void Renderer::queueReadbacks(bool is_wait)
+{
+  // Oldest first
+  for(int i = 0; i < READBACK_SLOTS; i++)
+  {
+    Readback& readback = m_readbacks[(m_readbackNext + i) % READBACK_SLOTS];
+    if(!readback.is_pending)
+      continue;
+    if(is_wait)
+      vkWaitForFences(m_device, 1, &readback.fence, VK_TRUE, UINT64_MAX);
+    else if(vkGetFenceStatus(m_device, readback.fence) != VK_SUCCESS)
+      continue;
+    writeReadback(readback);
+  }
+}
+
+void Renderer::writeReadback(Readback& readback)
+{
+  // The encoder emulates the post shader, unless the quantize pass did it already
+  if(readback.is_quantized)
+    readback.encoding = m_encoder.submit(readback.filename, readback.size.width, readback.size.height,
+                                         (const uint8_t*)readback.pixels, readback.sink);
+  else
+    readback.encoding = m_encoder.submit(readback.filename, readback.size.width, readback.size.height,
+                                         (const float*)readback.pixels, readback.sink);
+  readback.is_pending = false;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Gamma and quantization of saved images, the same as the encoder does on the CPU
+//
+void Renderer::createQuantizePipeline()
+{
+  m_quantizeDescSetLayoutBind.addBinding(QuantizeBindings::eQuantizeImage, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,
+                                         VK_SHADER_STAGE_COMPUTE_BIT);
+  m_quantizeDescSetLayoutBind.addBinding(QuantizeBindings::eQuantizeThresholds, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                                         VK_SHADER_STAGE_COMPUTE_BIT);
+  m_quantizeDescSetLayout = m_quantizeDescSetLayoutBind.createLayout(m_device);
+  m_quantizeDescPool      = m_quantizeDescSetLayoutBind.createPool(m_device);
+  m_quantizeDescSet       = nvvk::allocateDescriptorSet(m_device, m_quantizeDescPool, m_quantizeDescSetLayout);
+
+  // The thresholds come from the encoder, so both paths give the same bytes
+  const float*       thresholds = m_encoder.getGamma().getThresholds();
+  std::vector<float> hostThresholds(thresholds, thresholds + 257);
+  nvvk::CommandPool  cmdGen(m_device, m_graphicsQueueIndex);
+  VkCommandBuffer    cmdBuf = cmdGen.createCommandBuffer();
+  m_bThresholds             = m_alloc.createBuffer(cmdBuf, hostThresholds, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  cmdGen.submitAndWait(cmdBuf);
+  m_alloc.finalizeAndReleaseStaging();
+
+  VkDescriptorBufferInfo thresholdsInfo{m_bThresholds.buffer, 0, VK_WHOLE_SIZE};
+  VkWriteDescriptorSet   wds = m_quantizeDescSetLayoutBind.makeWrite(m_quantizeDescSet, QuantizeBindings::eQuantizeThresholds, &thresholdsInfo);
+  vkUpdateDescriptorSets(m_device, 1, &wds, 0, nullptr);
+  updateQuantizeDescriptorSet();
+
+  VkPushConstantRange        pushConstant{VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstantQuantize)};
+  VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo{VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO};
+  pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+  pipelineLayoutCreateInfo.pPushConstantRanges    = &pushConstant;
+  pipelineLayoutCreateInfo.setLayoutCount         = 1;
+  pipelineLayoutCreateInfo.pSetLayouts            = &m_quantizeDescSetLayout;
+  vkCreatePipelineLayout(m_device, &pipelineLayoutCreateInfo, nullptr, &m_quantizePipelineLayout);
+
+  VkComputePipelineCreateInfo computePipelineCreateInfo{VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
+  computePipelineCreateInfo.layout       = m_quantizePipelineLayout;
+  computePipelineCreateInfo.stage.sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  computePipelineCreateInfo.stage.module = nvvk::createShaderModule(m_device, nvh::loadFile("spv/quantize.comp.spv", true, defaultSearchPaths, true));
+  computePipelineCreateInfo.stage.stage  = VK_SHADER_STAGE_COMPUTE_BIT;
+  computePipelineCreateInfo.stage.pName  = "main";
+  vkCreateComputePipelines(m_device, {}, 1, &computePipelineCreateInfo, nullptr, &m_quantizePipeline);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Required when changing resolution
+//
+void Renderer::updateQuantizeDescriptorSet()
+{
+  if(m_quantizeDescSet == VK_NULL_HANDLE)
+    return;
+  VkDescriptorImageInfo imageInfo{{}, m_offscreenColor.descriptor.imageView, VK_IMAGE_LAYOUT_GENERAL};
+  VkWriteDescriptorSet  wds = m_quantizeDescSetLayoutBind.makeWrite(m_quantizeDescSet, QuantizeBindings::eQuantizeImage, &imageInfo);
+  vkUpdateDescriptorSets(m_device, 1, &wds, 0, nullptr);
+}
+
+void Renderer::quantizeToBuffer(const VkCommandBuffer& cmdBuf, const nvvk::Buffer& pixelBufferOut)
+{
+  m_debug.beginLabel(cmdBuf, "Quantize");
+
+  // The ray tracer output must be written before it's read here
+  VkMemoryBarrier beforeBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  beforeBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  beforeBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                       &beforeBarrier, 0, nullptr, 0, nullptr);
+
+  PushConstantQuantize pc{};
+  pc.pixelAddress = nvvk::getBufferDeviceAddress(m_device, pixelBufferOut.buffer);
+  pc.size         = {(int)m_size.width, (int)m_size.height};
+  vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_quantizePipeline);
+  vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_quantizePipelineLayout, 0, 1, &m_quantizeDescSet, 0, nullptr);
+  vkCmdPushConstants(cmdBuf, m_quantizePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstantQuantize), &pc);
+  vkCmdDispatch(cmdBuf, (m_size.width + (GROUP_SIZE - 1)) / GROUP_SIZE, (m_size.height + (GROUP_SIZE - 1)) / GROUP_SIZE, 1);
+
+  // The pixels go to the host, and the next frame may only overwrite the image once they're read
+  VkMemoryBarrier afterBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  afterBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  afterBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                       1, &afterBarrier, 0, nullptr, 0, nullptr);
+
+  m_debug.endLabel(cmdBuf);
 }
 
 
@@ -12,8 +12,12 @@
 #define FRAMES_TO_RENDER 50
 #define FRAMES_PER_CONV_STEP 30
 #define PRTS_PER_SIZE 100
+// Saved images copied from the GPU at once; saving one more waits for the oldest
+#define READBACK_SLOTS 3
 
 #include <list>
+#include <atomic>
+#include <array>
 
 #include "nvvkhl/appbase_vk.hpp"
 #include "nvvk/debug_util_vk.hpp"
@@ -21,12 +25,25 @@
 #include "nvvk/memallocator_dma_vk.hpp"
 #include "nvvk/resourceallocator_vk.hpp"
 #include "shaders/host_device.h"
+#include "ImageEncoder.h"
 
 // #VKRay
 #include "nvvk/raytraceKHR_vk.hpp"
 #include "nvvk/sbtwrapper_vk.hpp"
 
 
+// The nvvk builder builds the TLAS once and then only updates it, which can't change the instance count.
+// This one can drop the TLAS to build it anew
+class RaytracingBuilder : public nvvk::RaytracingBuilderKHR
+{
+public:
+  void destroyTlas()
+  {
+    m_alloc->destroy(m_tlas);
+    m_tlas = {};
+  }
+};
+
 struct ModelIndices {
   uint32_t cube_pos_idx;
   uint32_t cube_neg_idx;
@@ -96,8 +113,77 @@ public:
   void onMouseMotion(int x, int y) override;
   void destroyResources();
   void prepareFrame();
-  void saveImage(const std::string& outFilename);
-  void imageToBuffer(const nvvk::Texture& imgIn, const VkBuffer& pixelBufferOut);
+  // Builds the TLAS from the given instances instead of m_tlas, if any
+  void prepareFrame(const std::vector<VkAccelerationStructureInstanceKHR>* tlas);
+  // Starts copying the rendered image; it's written once the copy is done, see processReadbacks.
+  // The sink must outlive the write; PNG if there's none
+  void saveImage(const std::string& outFilename, OutputSink* sink = nullptr);
+  void imageToBuffer(const VkCommandBuffer& cmdBuf, const nvvk::Texture& imgIn, const VkBuffer& pixelBufferOut);
+  // Hands the saved images whose copies are done to the encoder. With is_wait, waits until all of them are written
+  void processReadbacks(bool is_wait = false);
+  // Saves the image saved as previousFilename again, without copying anything from the GPU
+  void repeatImage(const std::string& previousFilename, const std::string& outFilename, OutputSink* sink = nullptr);
+  // Of everything the ray tracer output depends on: instances, camera, size and settings.
+  // Materials are fixed once loaded; the instances select them
+  uint64_t hashSceneState() const;
+
+  // Persistent staging buffer for saved images, with its own command buffer and fence.
+  // It stays mapped; the encoder reads the pixels from it
+  struct Readback
+  {
+    nvvk::Buffer    buffer;
+    const void*     pixels{nullptr};
+    bool            is_quantized{false};  // RGBA8 from the quantize pass, RGBA32F otherwise
+    uint64_t        encoding{0};  // Encoder ticket of the image in the buffer, 0 if none
+    VkExtent2D      size{0, 0};
+    VkCommandBuffer cmdBuf{VK_NULL_HANDLE};
+    VkFence         fence{VK_NULL_HANDLE};
+    std::string     filename;
+    OutputSink*     sink{nullptr};
+    bool            is_pending{false};
+  };
+  std::array<Readback, READBACK_SLOTS> m_readbacks;
+  VkCommandPool                        m_readbackPool{VK_NULL_HANDLE};
+  int                                  m_readbackNext{0};  // Slot used next, the oldest one
+  void createReadbacks();
+  void destroyReadbacks();
+  void writeReadback(Readback& readback);
+  // Hands the readbacks to the encoder in order, the pending ones too with is_wait
+  void queueReadbacks(bool is_wait);
+  ImageEncoder                         m_encoder;
+
+  // #Quantize - Gamma and 8-bit conversion of saved images on the GPU, a quarter of the data to read back
+  void createQuantizePipeline();
+  void updateQuantizeDescriptorSet();
+  // Records the quantize pass of the offscreen image into the buffer
+  void quantizeToBuffer(const VkCommandBuffer& cmdBuf, const nvvk::Buffer& pixelBufferOut);
+  bool                        m_isGpuQuantize{true};
+  nvvk::DescriptorSetBindings m_quantizeDescSetLayoutBind;
+  VkDescriptorPool            m_quantizeDescPool{VK_NULL_HANDLE};
+  VkDescriptorSetLayout       m_quantizeDescSetLayout{VK_NULL_HANDLE};
+  VkDescriptorSet             m_quantizeDescSet{VK_NULL_HANDLE};
+  VkPipelineLayout            m_quantizePipelineLayout{VK_NULL_HANDLE};
+  VkPipeline                  m_quantizePipeline{VK_NULL_HANDLE};
+  nvvk::Buffer                m_bThresholds;  // Of the encoder's GammaTable
+
+  // #Convergence - The path tracer counts the pixels whose mean is still noisy after every pass,
+  // so the recording can stop accumulating a frame once it's clean
+  void createConvergence();
+  void destroyConvergence();
+  // Signals when the last ray traced pass is done; call once its frame is submitted
+  void markPass();
+  // Noisy pixels of the pass traced the given number of passes ago, waiting for it if needed.
+  // -1 if that pass wasn't marked
+  int  getNoisyPixels(int passesAgo);
+  // At most m_maxNoisyFraction of the pixels noisy
+  bool isConverged(int passesAgo);
+  float                                  m_maxNoisyFraction{0.001f};
+  nvvk::Buffer                           m_bVariances;  // Sized with the offscreen image
+  nvvk::Buffer                           m_bNoisyCounts;  // Host visible, CONVERGENCE_SLOTS counts
+  const uint32_t*                        m_noisyCounts{nullptr};
+  std::array<VkFence, CONVERGENCE_SLOTS> m_passFences{};
+  std::array<int64_t, CONVERGENCE_SLOTS> m_markedPasses{};  // Pass signaled by each fence, -1 if none
+  int64_t                                m_passCount{0};  // Ray traced passes since the start
 
   // The OBJ model
   struct ObjModel
@@ -160,17 +246,25 @@ public:
   auto objectToVkGeometryKHR(const ObjModel& model);
   void createBottomLevelAS();
   void createTopLevelAS();
+  // Instances added to m_instances since the TLAS was created go to m_tlas, hidden until moved.
+  // The next prepareFrame builds the TLAS with them
+  void appendInstances();
+  // Builds a new TLAS for a different number of instances
+  void rebuildTopLevelAS(const std::vector<VkAccelerationStructureInstanceKHR>& instances);
+  size_t m_tlasInstanceCount{0};  // In the built TLAS
   void createRtDescriptorSet();
   void updateRtDescriptorSet();
   void createRtPipelineLayout();
   void createRtPipeline(std::string shader, VkPipeline& pipeline);
   void raytrace(const VkCommandBuffer& cmdBuf, const nvmath::vec4f& clearColor, VkPipeline& pipeline);
 
+  // Can be called from any thread; the accumulation restarts at the next frame
   void resetFrame();
   void updateFrame();
+  std::atomic<bool> is_reset_frame{false};
 
   VkPhysicalDeviceRayTracingPipelinePropertiesKHR m_rtProperties{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR};
-  nvvk::RaytracingBuilderKHR                      m_rtBuilder;
+  RaytracingBuilder                               m_rtBuilder;
   nvvk::DescriptorSetBindings                     m_rtDescSetLayoutBind;
   VkDescriptorPool                                m_rtDescPool;
   VkDescriptorSetLayout                           m_rtDescSetLayout;
@@ -187,5 +281,5 @@ public:
   VkStridedDeviceAddressRegionKHR m_callRegion{};
 
   // Push constant for ray tracer
-  PushConstantRay m_pcRay{.debugging_mode = 0, .minHeatmap = 0, .maxHeatmap = 3000000};
+  PushConstantRay m_pcRay{.debugging_mode = 0, .minHeatmap = 0, .maxHeatmap = 3000000, .noiseThreshold = 0.02f};
 };
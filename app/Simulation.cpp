@@ -0,0 +1,59 @@
+#include "Simulation.h"
+
+Simulation::Simulation(Renderer &renderer, std::function<void()> step) : renderer(renderer), step(step) {
+}
+
+Simulation::~Simulation() {
+    stop();
+}
+
+void Simulation::start() {
+    if (isRunning()) return;
+    is_stopping = false;
+    is_step_requested = false;
+    thread = std::thread(&Simulation::run, this);
+}
+
+void Simulation::stop() {
+    if (!isRunning()) return;
+    {
+        std::lock_guard<std::mutex> lock(step_mutex);
+        is_stopping = true;
+    }
+    step_cv.notify_one();
+    thread.join();
+    // The last snapshot may not have been consumed; the instances are up to date anyway
+    snapshots.consume();
+    renderer.is_rebuild_tlas = true;
+}
+
+void Simulation::requestStep() {
+    {
+        std::lock_guard<std::mutex> lock(step_mutex);
+        is_step_requested = true;
+    }
+    step_cv.notify_one();
+}
+
+const std::vector<VkAccelerationStructureInstanceKHR>* Simulation::consume() {
+    return snapshots.consume() ? &snapshots.front() : nullptr;
+}
+
+void Simulation::run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(step_mutex);
+            step_cv.wait(lock, [this]() { return is_step_requested || is_stopping; });
+            if (is_stopping) return;
+            is_step_requested = false;
+        }
+
+        std::lock_guard<std::mutex> lock(state_mutex);
+        step();
+        if (renderer.is_rebuild_tlas) {
+            snapshots.back() = renderer.m_tlas;
+            snapshots.publish();
+            renderer.is_rebuild_tlas = false;
+        }
+    }
+}
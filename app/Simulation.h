@@ -0,0 +1,69 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Renderer.h"
+
+// Hands the latest value from one producer thread to one consumer thread without locking.
+// The producer fills back() and publishes it; the consumer picks up the newest published one
+template<typename T>
+class TripleBuffer {
+public:
+    T& back() { return buffers[back_idx]; }
+    const T& front() const { return buffers[front_idx]; }
+
+    void publish() {
+        back_idx = middle.exchange(back_idx | DIRTY_BIT) & INDEX_MASK;
+    }
+
+    // False if nothing was published since the last call
+    bool consume() {
+        if (!(middle.load() & DIRTY_BIT)) return false;
+        front_idx = middle.exchange(front_idx) & INDEX_MASK;
+        return true;
+    }
+
+private:
+    static constexpr int DIRTY_BIT = 4;
+    static constexpr int INDEX_MASK = 3;
+    T buffers[3];
+    int back_idx = 0;
+    std::atomic<int> middle{1};
+    int front_idx = 2;
+};
+
+// Runs the sequencer and the layers on their own thread, one step per rendered frame.
+// The animation of the next frame overlaps with the GPU work of the current one
+class Simulation {
+public:
+    // Held by the simulation while stepping; the render thread takes it to touch the layers, the sequencer or the camera
+    std::mutex state_mutex;
+
+    Simulation(Renderer &renderer, std::function<void()> step);
+    ~Simulation();
+    void start();
+    void stop();
+    bool isRunning() const { return thread.joinable(); }
+    void requestStep();
+    // Instances of the latest step that moved any, nullptr if there are none since the last call
+    const std::vector<VkAccelerationStructureInstanceKHR>* consume();
+
+private:
+    Renderer &renderer;
+    std::function<void()> step;
+    std::thread thread;
+    std::mutex step_mutex;
+    std::condition_variable step_cv;
+    bool is_step_requested = false;
+    bool is_stopping = false;
+    TripleBuffer<std::vector<VkAccelerationStructureInstanceKHR>> snapshots;
+
+    void run();
+};
+
+#endif
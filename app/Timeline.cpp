@@ -0,0 +1,139 @@
+#include "Timeline.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+void TimelineBaker::begin(const std::string &path, int first_frame, int n_instances) {
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if (!file) throw std::runtime_error("Can't write " + path);
+    this->path = path;
+    header = {
+        .magic = TIMELINE_MAGIC,
+        .version = TIMELINE_VERSION,
+        .n_instances = (uint32_t)n_instances,
+        .n_frames = 0,
+        .first_frame = first_frame,
+        .reserved = 0,
+        .table_offset = 0
+    };
+    offsets.clear();
+    last.clear();
+    // Rewritten at the end, when the frames are known
+    file.write((const char*)&header, sizeof(header));
+    position = sizeof(header);
+}
+
+void TimelineBaker::addFrame(const std::vector<VkAccelerationStructureInstanceKHR> &tlas) {
+    if (tlas.size() != header.n_instances) throw std::runtime_error("Number of instances changed while baking");
+
+    records.clear();
+    bool is_first = last.empty();
+    if (is_first) last.resize(tlas.size());
+    for (int i = 0; i < tlas.size(); i++) {
+        const VkTransformMatrixKHR &transform = tlas[i].transform;
+        if (!is_first && memcmp(&transform, &last[i], sizeof(transform)) == 0) continue;
+        records.push_back({(uint32_t)i, transform});
+        last[i] = transform;
+    }
+
+    offsets.push_back(position);
+    header.n_frames++;
+    uint32_t count = records.size();
+    file.write((const char*)&count, sizeof(count));
+    file.write((const char*)records.data(), records.size() * sizeof(TimelineRecord));
+    position += sizeof(count) + records.size() * sizeof(TimelineRecord);
+}
+
+void TimelineBaker::end() {
+    const char padding[8] = {};
+    uint64_t n_padding = (8 - position % 8) % 8;
+    file.write(padding, n_padding);
+    header.table_offset = position + n_padding;
+    file.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+    file.seekp(0);
+    file.write((const char*)&header, sizeof(header));
+    file.close();
+    if (file.fail()) throw std::runtime_error("Failed to write the timeline");
+    std::cout << "Baked " << header.n_frames << " frames" << std::endl;
+}
+
+void TimelineBaker::discard() {
+    if (path.empty()) return;
+    if (file.is_open()) file.close();
+    std::remove(path.c_str());
+    path.clear();
+}
+
+void Timeline::load(const std::string &path) {
+    unload();
+    file.open(path);
+    if (file.getSize() < sizeof(TimelineHeader)) {
+        unload();
+        throw std::runtime_error("Timeline file is too short");
+    }
+    header = (const TimelineHeader*)file.getData();
+    if (header->magic != TIMELINE_MAGIC || header->version != TIMELINE_VERSION) {
+        unload();
+        throw std::runtime_error("Not a baked timeline: " + path);
+    }
+    if (header->table_offset % 8 != 0 || file.getSize() < header->table_offset + header->n_frames * sizeof(uint64_t)) {
+        unload();
+        throw std::runtime_error("Timeline file is too short");
+    }
+    offsets = (const uint64_t*)(file.getData() + header->table_offset);
+    // The records of every frame lie between the header and the table
+    for (uint32_t i = 0; i < header->n_frames; i++) {
+        uint32_t count = 0;
+        bool is_valid = offsets[i] >= sizeof(TimelineHeader) && offsets[i] + sizeof(count) <= header->table_offset;
+        if (is_valid) {
+            memcpy(&count, file.getData() + offsets[i], sizeof(count));
+            is_valid = offsets[i] + sizeof(count) + (uint64_t)count * sizeof(TimelineRecord) <= header->table_offset;
+        }
+        if (!is_valid) {
+            unload();
+            throw std::runtime_error("Timeline frame " + std::to_string(i) + " is out of the file");
+        }
+    }
+    current = -1;
+}
+
+void Timeline::unload() {
+    file.close();
+    header = nullptr;
+    offsets = nullptr;
+    current = -1;
+}
+
+uint32_t Timeline::applyRecords(int baked_frame, Renderer &renderer) {
+    const uint8_t *frame = file.getData() + offsets[baked_frame];
+    uint32_t count;
+    memcpy(&count, frame, sizeof(count));
+    const TimelineRecord *records = (const TimelineRecord*)(frame + sizeof(count));
+    for (uint32_t i = 0; i < count; i++) {
+        if (records[i].instance >= renderer.m_tlas.size()) throw std::runtime_error("Timeline instance is out of range");
+        renderer.m_tlas[records[i].instance].transform = records[i].transform;
+    }
+    return count;
+}
+
+bool Timeline::apply(int frame, Renderer &renderer) {
+    if (!isLoaded()) return false;
+    int baked_frame = frame - header->first_frame;
+    if (baked_frame < 0 || baked_frame >= header->n_frames) return false;
+    // Instances appended since the bake, like sweep windows, are left alone
+    if (renderer.m_tlas.size() < header->n_instances) throw std::runtime_error("Timeline was baked for another scene");
+    if (baked_frame == current) return true;
+
+    // Frames are deltas; going backwards starts over from the first, complete one
+    int from = baked_frame > current ? current + 1 : 0;
+    uint32_t n_applied = 0;
+    for (int i = from; i <= baked_frame; i++) n_applied += applyRecords(i, renderer);
+    current = baked_frame;
+    if (n_applied > 0) {
+        // Like the layers do, the accumulated image is of the previous frame
+        renderer.is_rebuild_tlas = true;
+        renderer.resetFrame();
+    }
+    return true;
+}
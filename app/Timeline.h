@@ -0,0 +1,70 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include "Renderer.h"
+#include "MappedFile.h"
+
+#define TIMELINE_MAGIC 0x424c5447      // "GTLB"
+#define TIMELINE_VERSION 1
+
+// Baked timeline file layout:
+//   TimelineHeader
+//   Frame records: uint32_t count, then count TimelineRecord
+//   uint64_t offsets[n_frames]        Frame records, from the file start; 8-byte aligned, at table_offset
+// The first frame holds every instance, the following ones only the instances changed since the previous frame
+struct TimelineHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_instances;
+    uint32_t n_frames;
+    int32_t first_frame;
+    uint32_t reserved;
+    uint64_t table_offset;
+};
+
+struct TimelineRecord {
+    uint32_t instance;
+    VkTransformMatrixKHR transform;
+};
+
+// Writes the TLAS transforms of consecutive frames into a baked timeline file
+class TimelineBaker {
+public:
+    void begin(const std::string &path, int first_frame, int n_instances);
+    void addFrame(const std::vector<VkAccelerationStructureInstanceKHR> &tlas);
+    void end();
+    // Closes and removes the file begun
+    void discard();
+
+private:
+    std::string path;
+    std::ofstream file;
+    TimelineHeader header;
+    uint64_t position;
+    std::vector<uint64_t> offsets;
+    std::vector<VkTransformMatrixKHR> last;
+    std::vector<TimelineRecord> records;
+};
+
+// Feeds the renderer from a baked timeline, the layers don't run at all
+class Timeline {
+public:
+    void load(const std::string &path);
+    void unload();
+    bool isLoaded() const { return file.isOpen(); }
+    // Sets the TLAS transforms of the frame. False if the frame wasn't baked
+    bool apply(int frame, Renderer &renderer);
+
+private:
+    MappedFile file;
+    const TimelineHeader *header = nullptr;
+    const uint64_t *offsets = nullptr;
+    int current = -1;           // Baked frame the TLAS holds now
+    // Returns the number of instances set
+    uint32_t applyRecords(int baked_frame, Renderer &renderer);
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include <array>
 #include <random>
 #include <iostream>
+#include <cstring>
 
 #define IMGUI_DEFINE_MATH_OPERATORS
 #include "backends/imgui_impl_glfw.h"
@@ -11,6 +12,9 @@
 #include "Renderer.h"
 #include "DataItem.h"
 #include "Layers.h"
+#include "Timeline.h"
+#include "Simulation.h"
+#include "OutputSink.h"
 #include "imgui/imgui_camera_widget.h"
 #include "nvh/cameramanipulator.hpp"
 #include "nvh/fileoperations.hpp"
@@ -66,7 +70,23 @@ static int const SAMPLE_HEIGHT = 720;
 //
 int main(int argc, char** argv)
 {
-  UNUSED(argc);
+  nvh::InputParser parser(argc, argv);
+  if (parser.exist("--bench-sequencer")) {
+    VRaF::benchmarkEvents(parser.getInt("--bench-keys", 1000000));
+    return 0;
+  }
+  // Where the recorded frames go: --output png|y4m|raw, and --output-target for the streams,
+  // a file or "|command" to pipe them to
+  int output_format = OUTPUT_PNG;
+  std::string output_name = parser.getString("--output", "png");
+  if (output_name == "y4m") output_format = OUTPUT_Y4M;
+  if (output_name == "raw") output_format = OUTPUT_RAW;
+  char output_target[256] = {};
+  strncpy(output_target, parser.getString("--output-target", output_format == OUTPUT_RAW ? "recording.rgb" : "recording.y4m").c_str(),
+          sizeof(output_target) - 1);
+  // Recorded frames accumulate until they're clean, within these bounds
+  int min_passes = std::max(2, parser.getInt("--min-passes", 8));
+  int max_passes = parser.getInt("--max-passes", FRAMES_TO_RENDER);
 
   // Setup GLFW window
   glfwSetErrorCallback(onErrorCallback);
@@ -199,6 +219,7 @@ int main(int argc, char** argv)
   renderer.createPostDescriptor();
   renderer.createPostPipeline();
   renderer.updatePostDescriptorSet();
+  renderer.createQuantizePipeline();
   nvmath::vec4f clearColor = nvmath::vec4f(1, 1, 1, 1.00f);
 
   bool          useRaytracer = false;
@@ -208,8 +229,9 @@ int main(int argc, char** argv)
 
   VRaF::Sequencer sequencer;
 
-  bool is_hide_output = false;
+  std::atomic<bool> is_hide_output{false};
   sequencer.onFrameUpdated([&](int frame) {if (frame == 1) {is_hide_output = true;}});
+  Layer::link(layers);
   for (Data &d : datas) d.show();
   for (Layer *l : layers) l->init();
   layers[0]->output.hide();
@@ -219,27 +241,58 @@ int main(int argc, char** argv)
   for (Layer* l : layers) l->setupSequencer(sequencer);
   sequencer.track("Camera pos", &renderer.camera.pos, updateCameraPos);
   sequencer.track("Camera tgt", &renderer.camera.tgt, updateCameraPos);
-  sequencer.loadFile("data/sequences.json");
+  // The binary sequence is preferred, the JSON one is for interchange
+  sequencer.loadFile(std::ifstream("data/sequences.vseq").good() ? "data/sequences.vseq" : "data/sequences.json");
   // Main loop
   float moveSpeed = 15.8;
   float lastTime = (float)glfwGetTime();
 
-  std::function<void(bool, bool, int)> showFrame = [&](bool showGUI, bool is_raytrace, int img_id) {
+  // In the replay mode, the instances come from the baked timeline and the layers are left alone
+  Timeline timeline;
+  bool is_replay = false;
+  std::vector<VkAccelerationStructureInstanceKHR> tlas_before_replay;
+
+  auto applyLayers = [&]() {
       for (Layer* layer : layers) {
         if (layer->state != layer->newState) {
-          bool is_pre = true;
           std::cout << "Applying " << layer->name << " update" << std::endl;
-          for (Layer* layer_other : layers) {
-            if (layer_other == layer) {
-              is_pre = false;
-              continue;
-            }
-            if (is_pre) layer_other->toMax();
-            else layer_other->toMin();
-          }
+          // Only the layers connected to the changed one are affected; the ones already in place are skipped
+          for (Layer* layer_other : layer->getUpstream()) layer_other->toMax();
+          for (Layer* layer_other : layer->getDownstream()) layer_other->toMin();
           layer->update();
+          layer->level = LEVEL_ACTIVE;
         }
       }
+  };
+
+  // A step of the simulation thread; the TLAS is built from the instances it leaves behind
+  Simulation simulation(renderer, [&]() {
+      sequencer.update((float)glfwGetTime());
+      if (is_replay) {
+        timeline.apply(sequencer.getFrame(), renderer);
+      } else {
+        applyLayers();
+      }
+      for (Layer* layer : layers) layer->prefetch(sequencer);
+  });
+
+  std::unique_ptr<OutputSink> recording_sink;
+  auto imageName = [](int frame) {
+    std::string name = std::to_string(frame);
+    name.insert(name.begin(), 5 - name.size(), '0');
+    return "images/" + name + ".png";
+  };
+  std::function<void(bool, bool, int)> showFrame = [&](bool showGUI, bool is_raytrace, int img_id) {
+      // While recording, the simulation is stopped and every frame is stepped here, in order
+      const bool is_async = simulation.isRunning();
+      std::unique_lock<std::mutex> state_lock(simulation.state_mutex, std::defer_lock);
+      if (is_async) {
+        state_lock.lock();
+      } else if (is_replay) {
+        timeline.apply(sequencer.getFrame(), renderer);
+      } else {
+        applyLayers();
+      }
 
       // Start the Dear ImGui frame
       ImGui_ImplGlfw_NewFrame();
@@ -260,8 +313,59 @@ int main(int argc, char** argv)
         if (ImGui::Button("Save image")) {
           renderer.saveImage("result.png");
         }
+        ImGui::SameLine();
+        ImGui::Checkbox("Quantize on GPU", &renderer.m_isGpuQuantize);
+        int compression = renderer.m_encoder.getCompression();
+        if (ImGui::SliderInt("PNG compression", &compression, 5, 12)) renderer.m_encoder.setCompression(compression);
+        ImGui::Combo("Recording output", &output_format, output_format_names, OUTPUT_COUNT);
+        if (output_format != OUTPUT_PNG) ImGui::InputText("Output target", output_target, sizeof(output_target));
+        ImGui::SliderFloat("Noise threshold", &renderer.m_pcRay.noiseThreshold, 0.001f, 0.1f, "%.3f");
+        ImGui::SliderInt("Min passes", &min_passes, 2, max_passes);
+        ImGui::SliderInt("Max passes", &max_passes, min_passes, 1000);
         if (!is_recording && ImGui::Button("Start recording")) is_recording = true;
-        if (ImGui::Button("Save sequence")) sequencer.saveFile("sequences.json");
+        if (ImGui::Button("Save sequence")) sequencer.saveFile("sequences.vseq");
+        ImGui::SameLine();
+        if (ImGui::Button("Export JSON")) sequencer.saveFile("sequences.json");
+        if (!is_replay && ImGui::Button("Bake timeline")) {
+          // Runs the layers once over the whole sequence; the replay mode reads the result back
+          // The sweep may turn on anywhere in the sequence, its instances are there from the start
+          for (Layer* layer : layers) layer->allocateSweep();
+          TimelineBaker baker;
+          bool is_first = true;
+          try {
+            for (int frame : sequencer) {
+              if (is_first) baker.begin("timeline.bin", frame, renderer.m_tlas.size());
+              is_first = false;
+              applyLayers();
+              baker.addFrame(renderer.m_tlas);
+            }
+            if (!is_first) baker.end();
+          } catch (const std::runtime_error& e) {
+            std::cout << e.what() << std::endl;
+            // A partial timeline would fail to load anyway
+            baker.discard();
+          }
+        }
+        if (ImGui::Checkbox("Replay baked timeline", &is_replay)) {
+          if (is_replay) {
+            try {
+              timeline.load("timeline.bin");
+              tlas_before_replay = renderer.m_tlas;
+            } catch (const std::runtime_error& e) {
+              std::cout << e.what() << std::endl;
+              is_replay = false;
+            }
+          } else {
+            // The layers expect the instances they've placed themselves
+            timeline.unload();
+            // Instances appended during the replay stay
+            tlas_before_replay.insert(tlas_before_replay.end(), renderer.m_tlas.begin() + tlas_before_replay.size(), renderer.m_tlas.end());
+            renderer.m_tlas = tlas_before_replay;
+            renderer.is_rebuild_tlas = true;
+          }
+          renderer.resetFrame();
+        }
+        if (ImGui::Button("Bake generated tracks")) sequencer.bakeGenerators();
         if (ImGui::Button("Generate sequence")) {
 
           sequencer.clear();
@@ -269,23 +373,30 @@ int main(int argc, char** argv)
           for (Layer* layer : layers) {
             int step_start = step_global;
             std::cout << layer->name << std::endl;
-            int nsteps_layer = layer->getWidth() * layer->getHeight() * layer->getDepth();
-            for (int step = 0; step < nsteps_layer; step++) {
-              int x = (step / layer->getHeight()) % layer->getWidth();
-              int y = step % layer->getHeight();
-              int z = layer->getHeight() / layer->getWidth();
- 
-              // std::cout << layer->name << ": " << x << ' ' << y << ' ' << z << std::endl;
-              int nsteps = nsteps_layer * (FRAMES_PER_CONV_STEP + 1);
-              for (int frame = 0; frame <= FRAMES_PER_CONV_STEP; frame++) {
-                int step_layer = step * (FRAMES_PER_CONV_STEP + 1) + frame;
-                float time = (float)frame / FRAMES_PER_CONV_STEP * (layer->getMaxTime() - layer->getMinTime()) + layer->getMinTime();
-                sequencer.addKeyframe((layer->name + std::string(": X")).c_str(), (float)step_layer / nsteps, nsteps, x, step_start);
-                sequencer.addKeyframe((layer->name + std::string(": Y")).c_str(), (float)step_layer / nsteps, nsteps, y, step_start);
-                sequencer.addKeyframe((layer->name + std::string(": Time")).c_str(), (float)step_layer / nsteps, nsteps, time, step_start);
-                step_global++;
-              }
-            }
+            // In the sweep mode, every step animates several consecutive windows. Every channel starts
+            // its raster over, so its last step may have fewer
+            int sweep = layer->getSweep();
+            int nsteps_channel = (layer->getWidth() * layer->getHeight() + sweep - 1) / sweep;
+            int nsteps_layer = nsteps_channel * layer->getDepth();
+            int nsteps = nsteps_layer * (FRAMES_PER_CONV_STEP + 1);
+            sequencer.addKeyframe(sequencer.getTrack(layer->name + ": Sweep"), 0, nsteps, sweep, step_start);
+            // The scan is computed from the frame; "Bake generated tracks" turns it into keyframes
+            VRaF::ScanGenerator scan = {
+              .output = VRaF::ScanGenerator::SCAN_X,
+              .width = layer->getWidth(),
+              .height = layer->getHeight(),
+              .stride = sweep,
+              .frames_per_step = FRAMES_PER_CONV_STEP + 1,
+              .nsteps = nsteps_layer,
+              .stage_min = layer->getMinTime(),
+              .stage_max = layer->getMaxTime()
+            };
+            sequencer.setGenerator(sequencer.getTrack(layer->name + ": X"), scan, step_start);
+            scan.output = VRaF::ScanGenerator::SCAN_Y;
+            sequencer.setGenerator(sequencer.getTrack(layer->name + ": Y"), scan, step_start);
+            scan.output = VRaF::ScanGenerator::SCAN_STAGE;
+            sequencer.setGenerator(sequencer.getTrack(layer->name + ": Time"), scan, step_start);
+            step_global += nsteps;
           }
         }
         bool temp = renderer.m_pcRay.debugging_mode == eHeatmap;
@@ -302,6 +413,11 @@ int main(int argc, char** argv)
         }
 
         renderUI(renderer);
+        int clock = sequencer.getClock();
+        if (ImGui::Combo("Playback clock", &clock, VRaF::clock_names, VRaF::PLAYBACK_COUNT)) {
+          sequencer.setClock((VRaF::PlaybackClock)clock);
+        }
+        if (clock == VRaF::PLAYBACK_REALTIME) ImGui::Text("Dropped frames: %d", sequencer.getDroppedFrames());
         ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
         ImGuiH::Panel::End();
       }
@@ -309,9 +425,17 @@ int main(int argc, char** argv)
       sequencer.draw();
       ImGui::End();
 
-      sequencer.update((float)glfwGetTime());
-
-      renderer.prepareFrame();
+      if (is_async) {
+        state_lock.unlock();
+        // The next frame is animated while this one renders
+        simulation.requestStep();
+        renderer.prepareFrame(simulation.consume());
+      } else {
+        sequencer.update((float)glfwGetTime());
+        // Prepare the upcoming windows, so the playback doesn't stall on them
+        for (Layer* layer : layers) layer->prefetch(sequencer);
+        renderer.prepareFrame();
+      }
 
       // Start command buffer of this frame
       auto                   curFrame = renderer.getCurFrame();
@@ -322,7 +446,9 @@ int main(int argc, char** argv)
       vkBeginCommandBuffer(cmdBuf, &beginInfo);
 
       // Updating camera buffer
+      if (is_async) state_lock.lock();
       renderer.updateUniformBuffer(cmdBuf);
+      if (is_async) state_lock.unlock();
 
       // Clearing screen
       std::array<VkClearValue, 2> clearValues{};
@@ -339,13 +465,6 @@ int main(int argc, char** argv)
         }
       }
 
-      if (img_id >=  0) {
-        std::string img_name = std::to_string(img_id);
-        img_name.insert(img_name.begin(), 5 - img_name.size(), '0');
-        renderer.saveImage("images/" + img_name + ".png");
-        std::cout << img_name << std::endl;
-      }
-
       // 2nd rendering pass: tone mapper, UI
       {
         VkRenderPassBeginInfo postRenderPassBeginInfo{VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
@@ -367,20 +486,68 @@ int main(int argc, char** argv)
       // Submit for display
       vkEndCommandBuffer(cmdBuf);
       renderer.submitFrame();
+      // Copied after the frame is submitted, for the image to have its pass
+      if (img_id >=  0) {
+        renderer.saveImage(imageName(img_id), recording_sink.get());
+        std::cout << imageName(img_id) << std::endl;
+      }
+      // Saved images are written once their copies are done, the rendering goes on meanwhile
+      renderer.processReadbacks();
       if (is_recording) {
         is_recording = false;
+        try {
+          recording_sink = createOutputSink((OutputFormat)output_format, output_target, sequencer.getFps());
+        } catch (const std::runtime_error& e) {
+          std::cout << e.what() << std::endl;
+          return;
+        }
+        simulation.stop();
+        // Frames whose scene is the same as the one before reuse its image
+        uint64_t previous_hash = 0;
+        int previous_frame = -1;
         for (int frame : sequencer) {
-          for (int i = 0; i < FRAMES_TO_RENDER; i++) {
-            int image_id = i == FRAMES_TO_RENDER - 1 ? frame : -1;
-            showFrame(false, true, image_id);
+          // Placed ahead of the passes, for the hash to see the frame
+          if (is_replay) {
+            timeline.apply(frame, renderer);
+          } else {
+            applyLayers();
           }
+          uint64_t hash = renderer.hashSceneState();
+          if (previous_frame >= 0 && hash == previous_hash) {
+            renderer.repeatImage(imageName(previous_frame), imageName(frame), recording_sink.get());
+            std::cout << "Frame " << frame << ": unchanged, reusing " << previous_frame << std::endl;
+            continue;
+          }
+          previous_hash = hash;
+          previous_frame = frame;
+
+          int passes = 0;
+          bool is_done = false;
+          while (!is_done) {
+            // The image is saved with the pass about to be traced. The last traced one is likely still
+            // rendering, the one before it tells if the image is clean
+            is_done = passes + 1 >= max_passes || (passes >= min_passes && renderer.isConverged(2));
+            showFrame(false, true, is_done ? frame : -1);
+            renderer.markPass();
+            passes++;
+          }
+          std::cout << "Frame " << frame << ": " << passes << " passes" << std::endl;
         }
+        renderer.processReadbacks(true);
+        // Closes the stream
+        recording_sink.reset();
+        simulation.start();
       }
   };
 
+  simulation.start();
   while(!glfwWindowShouldClose(window))
   {
-    glfwPollEvents();
+    {
+      // Input callbacks move the camera, which the sequencer may be animating
+      std::lock_guard<std::mutex> lock(simulation.state_mutex);
+      glfwPollEvents();
+    }
     if(renderer.isMinimized())
       continue;
 
@@ -388,7 +555,10 @@ int main(int argc, char** argv)
     lastTime = (float)glfwGetTime();
 
     float l = moveSpeed * dtime;
-    renderer.camera.move(l * renderer.camera.move_fw, l * renderer.camera.move_rt, l * renderer.camera.move_up);
+    {
+      std::lock_guard<std::mutex> lock(simulation.state_mutex);
+      renderer.camera.move(l * renderer.camera.move_fw, l * renderer.camera.move_rt, l * renderer.camera.move_up);
+    }
     if (is_hide_output) {
       // data_out.hide();
       is_hide_output = false;
@@ -398,6 +568,7 @@ int main(int argc, char** argv)
   }
 
   // Cleanup
+  simulation.stop();
   vkDeviceWaitIdle(renderer.getDevice());
 
   // delete f;
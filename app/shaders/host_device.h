@@ -62,10 +62,17 @@ START_BINDING(RtxBindings)
   eTlas     = 0,  // Top-level acceleration structure
   eOutImage = 1   // Ray tracer output image
 END_BINDING();
+
+START_BINDING(QuantizeBindings)
+  eQuantizeImage      = 0,  // Ray tracer output image
+  eQuantizeThresholds = 1   // Smallest value of every 8-bit output, see GammaTable
+END_BINDING();
 // clang-format on
 
 
 #define GROUP_SIZE 8
+// Noisy pixel counts of the last passes kept for the host, see Renderer::markPass
+#define CONVERGENCE_SLOTS 4
 // Information of a obj model when referenced in a shader
 struct ObjDesc
 {
@@ -110,6 +117,17 @@ struct PushConstantRay
   ivec2 size;                   // rendering size
   int   minHeatmap;             // Debug mode - heat map
   int   maxHeatmap;
+  float noiseThreshold;         // Standard error of a pixel relative to its luminance, above which it's noisy
+  int   convergenceSlot;        // Where the pass counts its noisy pixels
+  uint64_t varianceAddress;     // Sum of squared differences of the pass luminances, a float per pixel
+  uint64_t convergenceAddress;  // Noisy pixel count per slot
+};
+
+// Push constant structure for the quantization of saved images
+struct PushConstantQuantize
+{
+  uint64_t pixelAddress;  // RGBA8 output, a row after the other
+  ivec2    size;
 };
 
 struct Vertex  // See ObjLoader, copy of VertexObj, could be compressed for device
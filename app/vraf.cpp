@@ -2,6 +2,14 @@
 #include <iostream>
 #include <string>
 #include <filesystem>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include "MappedFile.h"
 namespace fs = std::filesystem;
 
 // It's private flag in ImGui ImGuiButtonFlags_AllowItemOverlap; but SetItemAllowOverlap() function alone doesn't work
@@ -29,6 +37,9 @@ inline ImVec2 operator*(const ImVec2& vec, const float value) {
 
 namespace VRaF {
 
+	static const char* interpolation_names[INTERP_COUNT] = { "step", "linear", "hermite", "ease" };
+	const char* clock_names[PLAYBACK_COUNT] = { "Fixed step", "Real time", "Free run" };
+
 	static struct Theme_ {
 		float headerWidth = 180.0;
 		float headerHeight = 40.0;
@@ -214,6 +225,16 @@ namespace VRaF {
 				}
 				track.recordings.clear();
 			}
+			// There's no icon for it, so it's a plain letter
+			ImGui::SetCursorPos({ Theme.headerWidth - btn_width * 4, cursor_y });
+			ImGui::PushFont(labels);
+			if (ImGui::Button("D", ImVec2(0, Theme.trackHeight))) {
+				for (Event& e : track.events) {
+					e.decimate();
+				}
+			}
+			if (ImGui::IsItemHovered()) ImGui::SetTooltip("Decimate keyframes");
+			ImGui::PopFont();
 
 			ImGui::PopFont();
 			ImGui::PopStyleColor();
@@ -391,23 +412,48 @@ namespace VRaF {
 				pos + ImVec2(halfBorder, 0) + ImVec2(size.x, 0),
 				pos + ImVec2(halfBorder, 0 + size.y) + ImVec2(size.x, 0),
 				ImGui::GetColorU32(ImGuiCol_Border, 1.0), borderWidth);
-			// Keyframes curve
+			// Keyframes curve. Only the visible part is drawn, a pixel column at a time;
+			// keys denser than that are drawn as a min-max bar
 			if (event.keyframes.size() > 0) {
-				float keymax = 0, keymin = 9999;
-				for (const std::pair<float, float>& key : event.keyframes) {
-					if (key.second > keymax) keymax = key.second;
-					if (key.second < keymin) keymin = key.second;
+				const std::vector<std::pair<float, float>>& keys = event.keyframes;
+				if (event.lod.revision != event.revision) {
+					event.lod.build(keys);
+					event.lod.revision = event.revision;
 				}
+				auto [keymin, keymax] = event.lod.range(0, keys.size());
 				float scale = size.y / (keymax - keymin);
-				ImVec2 last_point(0, size.y - (event.keyframes[0].second - keymin) * scale);
-				for (const std::pair<float, float>& key : event.keyframes) {
-					ImVec2 curr_point(event.duration * key.first * state.zoom.x, size.y - (key.second - keymin) * scale);
-					painter->AddLine(
-						pos - ImVec2(borderWidth, 0) + last_point, 
-						pos - ImVec2(borderWidth, 0) + curr_point,
-						ImGui::GetColorU32(ImGuiCol_ButtonHovered, 1.0));
-					last_point = curr_point;
+				const ImVec2 origin = pos - ImVec2(borderWidth, 0);
+				const float px_per_unit = event.duration * state.zoom.x;
+				auto keyPoint = [&](int i) {
+					return ImVec2(px_per_unit * keys[i].first, size.y - (keys[i].second - keymin) * scale);
+				};
+				auto keyAfter = [&](float x) {
+					return (int)(std::upper_bound(keys.begin(), keys.end(), x / px_per_unit,
+						[](float t, const std::pair<float, float>& key) { return t < key.first; }) - keys.begin());
+				};
+				const ImU32 color = ImGui::GetColorU32(ImGuiCol_ButtonHovered, 1.0);
+
+				float x_first = std::max(dims.C.x, origin.x) - origin.x;
+				float x_last = std::min(dims.X.x + dims.windowSize.x, origin.x + size.x + 2 * borderWidth) - origin.x;
+				int first = keyAfter(std::floor(x_first));
+				// The line enters the view from the last key before it
+				ImVec2 last_point = first > 0 ? keyPoint(first - 1) : keyPoint(0);
+				for (float x = std::floor(x_first); x < x_last && first < keys.size(); x += 1) {
+					int last = keyAfter(x + 1);
+					if (last == first) continue;
+					ImVec2 first_point = keyPoint(first);
+					painter->AddLine(origin + last_point, origin + first_point, color);
+					if (last - first > 1) {
+						auto [vmin, vmax] = event.lod.range(first, last);
+						painter->AddLine(
+							origin + ImVec2(x, size.y - (vmin - keymin) * scale),
+							origin + ImVec2(x, size.y - (vmax - keymin) * scale), color);
+					}
+					last_point = keyPoint(last - 1);
+					first = last;
 				}
+				// And leaves it towards the first key after it
+				if (first < keys.size()) painter->AddLine(origin + last_point, origin + keyPoint(first), color);
 			}
 
 			if (head_hovered)
@@ -669,6 +715,8 @@ namespace VRaF {
 		dims.titlebarHeight = 18.0f;
 		state = {
 			.isPlaying = false,
+			.clock = PLAYBACK_FIXED_STEP,
+			.droppedFrames = 0,
 			.startTime = 0,
 			.currTime = 0,
 			.frame = 0,
@@ -732,19 +780,65 @@ namespace VRaF {
 	void Sequencer::update(float time)
 	{
 		state.currTime = time;
-		if (state.isPlaying) {
-			int frame = state.frame;
-			if (state.frame < state.range[0]) state.frame = state.range[0];
-			if (state.frame > state.range[1]) {
-				state.startTime = state.currTime;
-				stop_recording();
-			}
-			state.frame = (state.currTime - state.startTime) * fps + state.range[0];
-			if (state.frame != frame) {
-				updateEvents(frame);
-                callback(frame);
+		if (!state.isPlaying) return;
+		if (state.frame < state.range[0]) state.frame = state.range[0];
+
+		// Frame the wall clock is at
+		int target = (state.currTime - state.startTime) * fps + state.range[0];
+		if (state.clock != PLAYBACK_REALTIME) {
+			if (state.clock == PLAYBACK_FIXED_STEP && target <= state.frame) return;
+			target = state.frame + 1;
+		}
+		if (target <= state.frame) return;
+
+		if (state.frame >= state.range[1]) {
+			// Loops back to the start
+			stop_recording();
+			state.startTime = state.currTime;
+			stepTo(state.range[0]);
+			return;
+		}
+		if (target > state.range[1]) target = state.range[1];
+
+		// The layers are applied once per update, after it; stepping through the frames in between
+		// would only overwrite the tracks. They are dropped
+		state.droppedFrames += target - state.frame - 1;
+		stepTo(target);
+		// The wall clock follows the frame, so switching to the real-time clock doesn't jump
+		if (state.clock != PLAYBACK_REALTIME) state.startTime = state.currTime - (float)(state.frame - state.range[0]) / fps;
+	}
+
+	void Sequencer::stepTo(int frame)
+	{
+		state.frame = frame;
+		updateEvents(frame);
+		if (callback) callback(frame);
+	}
+
+	void Sequencer::setClock(PlaybackClock clock)
+	{
+		state.clock = clock;
+		state.droppedFrames = 0;
+		state.startTime = state.currTime - (float)(state.frame - state.range[0]) / fps;
+	}
+
+	int Sequencer::getFrame() {
+		return state.frame;
+	}
+
+	bool Sequencer::peek(std::string label, int frame, float &value) {
+		return peek(getTrack(label), frame, value);
+	}
+
+	bool Sequencer::peek(TrackHandle handle, int frame, float &value) {
+		if (!handle.isValid()) return false;
+		for (Event& e : tracks[handle.index].events) {
+			if (e.time <= frame && e.time + e.duration >= frame) {
+				value = e.valueAt(frame);
+				return true;
 			}
 		}
+		return false;
 	}
 
 	void Sequencer::updateEvents() {
@@ -789,18 +883,22 @@ namespace VRaF {
 		// Transform all the recordings into events
 		for (Track& t : tracks) {
 			for (Recording& r : t.recordings) {
-				int time = r.keyframes[0].first;
-				int duration = r.keyframes[r.keyframes.size() - 1].first - time;
-				std::vector<std::pair<float, float>> event_frames;
+				if (r.keyframes->empty()) continue;
+				int time = r.keyframes->firstFrame();
+				int duration = std::max(r.keyframes->lastFrame() - time, 1);
 				for (Event& e : t.events) {
 					if (e.target == r.target) {
 						// TODO: Overwrite only the section captured by the recording
+						e.generator.reset();
 						e.keyframes.clear();
 						e.time = time;
 						e.duration = duration;
-						for (std::pair<int, float> frame : r.keyframes) {
-							e.keyframes.push_back({ (float)(frame.first - time) / duration, frame.second });
-						}
+						e.interpolation = INTERP_LINEAR;
+						r.keyframes->forEach([&](int frame, float value) {
+							e.keyframes.push_back({ (float)(frame - time) / duration, value });
+						});
+						e.revision++;
+						e.decimate();
 					}
 				}
 
@@ -809,55 +907,69 @@ namespace VRaF {
 		}
 	}
 
-	void Sequencer::track(std::string label, vec2* value)
+	TrackHandle Sequencer::track(std::string label, vec2* value)
 	{
-        track(label, value, [](){});
+        return track(label, value, [](){});
 	}
 
-	void Sequencer::track(std::string label, vec3* value)
+	TrackHandle Sequencer::track(std::string label, vec3* value)
 	{
-		track(label, value, [](){});
+		return track(label, value, [](){});
 	}
 
-	void Sequencer::track(std::string label, vec4* value)
+	TrackHandle Sequencer::track(std::string label, vec4* value)
 	{
-		track(label, value, [](){});
+		return track(label, value, [](){});
 	}
 
-	void Sequencer::track(std::string label, float* value)
+	TrackHandle Sequencer::track(std::string label, float* value)
 	{
-        track(label, value, [](){});
+        return track(label, value, [](){});
 	}
 
-    void Sequencer::track(std::string label, vec2* value, std::function<void()> callback) {
-        tracks.push_back({
+    TrackHandle Sequencer::track(std::string label, vec2* value, std::function<void()> callback) {
+        return addTrack({
 			.events = { { 0, 0, {}, &(value->x) }, { 0, 0, {}, &(value->y) }},
 			.label = label,
             .callback = callback }
 		);
     }
-    void Sequencer::track(std::string label, vec3* value, std::function<void()> callback) {
-        tracks.push_back({
+    TrackHandle Sequencer::track(std::string label, vec3* value, std::function<void()> callback) {
+        return addTrack({
 			.events = { { 0, 0, {}, &(value->x) }, { 0, 0, {}, &(value->y) }, { 0, 0, {}, &(value->z) }},
 			.label = label,
             .callback = callback }
 		);
     }
-    void Sequencer::track(std::string label, vec4* value, std::function<void()> callback) {
-        tracks.push_back({
+    TrackHandle Sequencer::track(std::string label, vec4* value, std::function<void()> callback) {
+        return addTrack({
 			.events = { { 0, 0, {}, &(value->x) }, { 0, 0, {}, &(value->y) }, { 0, 0, {}, &(value->z) }, { 0, 0, {}, &(value->w) }},
 			.label = label,
             .callback = callback }
 		);
     }
-    void Sequencer::track(std::string label, float* value, std::function<void()> callback) {
-		tracks.push_back({
+    TrackHandle Sequencer::track(std::string label, float* value, std::function<void()> callback) {
+		return addTrack({
 			.events = { { 0, 0, {}, value }},
 			.label = label,
             .callback = callback }
 		);
     }
 
+	TrackHandle Sequencer::addTrack(Track track) {
+		TrackHandle handle = { (int)tracks.size() };
+		// With repeated labels, the first track is the one found by label
+		track_index.emplace(track.label, handle.index);
+		tracks.push_back(std::move(track));
+		return handle;
+	}
+
+	TrackHandle Sequencer::getTrack(const std::string& label) const {
+		auto it = track_index.find(label);
+		if (it == track_index.end()) return {};
+		return { it->second };
+	}
+
 	void Sequencer::toggle()
 	{
 		if (state.isPlaying) {
@@ -866,6 +978,7 @@ namespace VRaF {
 		}
 		else {
 			state.isPlaying = true;
+			state.droppedFrames = 0;
 			state.startTime = state.currTime - (float)(state.frame - state.range[0]) / fps;
 		}
 	}
@@ -878,17 +991,24 @@ namespace VRaF {
 		// Loads keyframes from a file. The tracked variables
 		// must be set before calling this function and must match
 		// the ones saved in the file
-		std::ifstream fs(path);
+		std::ifstream fs(path, std::ios::binary);
 		if (!fs.good()) {
 			std::cout << "File " << path << " is not good!" << std::endl;
 			return;
 		}
+		uint32_t magic = 0;
+		fs.read((char*)&magic, sizeof(magic));
+		if (fs.gcount() == sizeof(magic) && magic == VRAF_SEQ_MAGIC) {
+			fs.close();
+			loadBinary(path);
+			return;
+		}
+		fs.clear();
+		fs.seekg(0);
 		nlohmann::json data = nlohmann::json::parse(fs);
 		for (auto &jtrack : data["tracks"]) {
-			Track *track = 0;
-			for (Track &t : tracks) {
-				if (jtrack["label"] == t.label) track = &t;
-			}
+			TrackHandle handle = getTrack(jtrack["label"].get<std::string>());
+			Track *track = handle.isValid() ? &tracks[handle.index] : 0;
 			if (track == 0) {
 				std::cout << "Track with label " << jtrack["label"].get<std::string>() << " not found!" << std::endl;
 				continue;
@@ -902,10 +1022,39 @@ namespace VRaF {
 				// std::cout << "Event!" << std::endl;
 				track->events[i].duration = jevent["duration"];
 				track->events[i].time = jevent["time"];
+				// Sequences saved before the interpolation modes are step-wise
+				track->events[i].interpolation = INTERP_STEP;
+				if (jevent.contains("interpolation")) {
+					for (int mode = 0; mode < INTERP_COUNT; mode++) {
+						if (jevent["interpolation"] == interpolation_names[mode]) track->events[i].interpolation = (Interpolation)mode;
+					}
+				}
 				track->events[i].keyframes.clear();
 				for (auto &jkeyframe : jevent["keyframes"]) {
 					track->events[i].keyframes.push_back({jkeyframe["time"], jkeyframe["value"]});
 				}
+				track->events[i].sort();
+				track->events[i].generator.reset();
+				if (jevent.contains("generator")) {
+					auto &jgen = jevent["generator"];
+					ScanGenerator gen{
+						.output = (ScanGenerator::Output)jgen["output"].get<int>(),
+						.width = jgen["width"],
+						.height = jgen["height"],
+						.stride = jgen["stride"],
+						.is_x_major = jgen["is_x_major"],
+						.frames_per_step = jgen["frames_per_step"],
+						.nsteps = jgen["nsteps"],
+						.stage_min = jgen["stage_min"],
+						.stage_max = jgen["stage_max"]
+					};
+					if (gen.isValid()) {
+						track->events[i].generator = gen;
+					} else {
+						std::cout << "File " << path << " is not good: generator of " << jtrack["label"].get<std::string>()
+							<< " event " << i << " is out of range, skipped" << std::endl;
+					}
+				}
 				i++;
 			}
 		}
@@ -916,6 +1065,10 @@ namespace VRaF {
 	}
 
 	void Sequencer::saveFile(std::string path) {
+		if (fs::path(path).extension() == ".vseq") {
+			saveBinary(path);
+			return;
+		}
 		std::cout << "Saving: " << path << std::endl;
 		nlohmann::json jdata;
 		jdata["range_start"] = state.range[0];
@@ -932,6 +1085,21 @@ namespace VRaF {
 				nlohmann::json jevent;
 				jevent["time"] = event.time;
 				jevent["duration"] = event.duration;
+				jevent["interpolation"] = interpolation_names[event.interpolation];
+				if (event.generator) {
+					const ScanGenerator &gen = *event.generator;
+					jevent["generator"] = {
+						{"output", (int)gen.output},
+						{"width", gen.width},
+						{"height", gen.height},
+						{"stride", gen.stride},
+						{"is_x_major", gen.is_x_major},
+						{"frames_per_step", gen.frames_per_step},
+						{"nsteps", gen.nsteps},
+						{"stage_min", gen.stage_min},
+						{"stage_max", gen.stage_max}
+					};
+				}
 				jevent["keyframes"] = nlohmann::json::array();
 				for (std::pair<float, float> keyframe : event.keyframes) {
 					nlohmann::json jkeyframe;
@@ -948,6 +1116,303 @@ namespace VRaF {
 		fs << std::setw(4) << jdata;
 	}
 
+	/**
+	* Binary sequence layout, little-endian:
+	*
+	*   Header    magic, version, track count, range, pan, zoom, offset of the index
+	*   Events    of every track, one after another:
+	*               time, duration, interpolation, time & value encodings, key count,
+	*               value min & step, key times, key values, generator parameters if flagged
+	*   Index     for every track: label, event count, offset and size of its events
+	*
+	* Key times are stored as varint deltas of frames when they fall on frames exactly,
+	* values as 8 or 16 bit steps from the minimum when that is lossless; raw floats otherwise
+	*/
+	struct SeqHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t n_tracks;
+		int32_t range_start;
+		int32_t range_end;
+		float pan;
+		float zoom;
+		uint32_t reserved;
+		uint64_t index_offset;
+	};
+
+	// Version 1 files have no flags, the byte is zero there
+	#define SEQ_FLAG_GENERATOR 1
+
+	enum SeqEncoding {
+		SEQ_FLOAT,
+		SEQ_VARINT,		// Times only
+		SEQ_UINT8,		// Values only
+		SEQ_UINT16		// Values only
+	};
+
+	class SeqWriter {
+	public:
+		std::vector<uint8_t> data;
+
+		template<typename T>
+		void put(T value) {
+			const uint8_t* bytes = (const uint8_t*)&value;
+			data.insert(data.end(), bytes, bytes + sizeof(T));
+		}
+		void putVarint(uint32_t value) {
+			while (value >= 0x80) {
+				data.push_back((value & 0x7f) | 0x80);
+				value >>= 7;
+			}
+			data.push_back(value);
+		}
+	};
+
+	// Reads straight from the mapped file; throws once past the end
+	class SeqReader {
+	public:
+		SeqReader(const uint8_t* data, size_t size) : begin(data), ptr(data), end(data + size) {}
+
+		template<typename T>
+		T get() {
+			if (end - ptr < (ptrdiff_t)sizeof(T)) throw std::runtime_error("Sequence file is truncated");
+			T value;
+			memcpy(&value, ptr, sizeof(T));
+			ptr += sizeof(T);
+			return value;
+		}
+		uint32_t getVarint() {
+			uint32_t value = 0;
+			for (int shift = 0; shift < 35; shift += 7) {
+				uint8_t byte = get<uint8_t>();
+				value |= (uint32_t)(byte & 0x7f) << shift;
+				if (!(byte & 0x80)) return value;
+			}
+			throw std::runtime_error("Sequence file has a broken varint");
+		}
+		std::string getString(uint32_t length) {
+			if (end - ptr < (ptrdiff_t)length) throw std::runtime_error("Sequence file is truncated");
+			std::string value((const char*)ptr, length);
+			ptr += length;
+			return value;
+		}
+		size_t remaining() const { return end - ptr; }
+		void seek(uint64_t offset) {
+			if (offset > (uint64_t)(end - begin)) throw std::runtime_error("Sequence file offset is out of range");
+			ptr = begin + offset;
+		}
+
+	private:
+		const uint8_t* begin;
+		const uint8_t* ptr;
+		const uint8_t* end;
+	};
+
+	static float dequantize(float value_min, float value_step, uint32_t steps) {
+		return value_min + steps * value_step;
+	}
+
+	static void writeEvent(SeqWriter& writer, const Event& event) {
+		const std::vector<std::pair<float, float>>& keys = event.keyframes;
+
+		// Times as frames, if every key is exactly on one
+		uint8_t time_encoding = event.duration > 0 ? SEQ_VARINT : SEQ_FLOAT;
+		std::vector<uint32_t> frames(keys.size());
+		for (int i = 0; i < keys.size() && time_encoding == SEQ_VARINT; i++) {
+			float frame = std::round(keys[i].first * event.duration);
+			if (frame < 0 || (float)(int)frame / event.duration != keys[i].first) time_encoding = SEQ_FLOAT;
+			else frames[i] = frame;
+			if (i > 0 && frames[i] < frames[i - 1]) time_encoding = SEQ_FLOAT;
+		}
+
+		// Values as steps from the minimum, the smallest gap between them being the step
+		float value_min = 0, value_step = 0;
+		std::vector<float> values(keys.size());
+		for (int i = 0; i < keys.size(); i++) values[i] = keys[i].second;
+		std::vector<float> sorted = values;
+		std::sort(sorted.begin(), sorted.end());
+		if (!sorted.empty()) value_min = sorted[0];
+		for (int i = 1; i < sorted.size(); i++) {
+			float gap = sorted[i] - sorted[i - 1];
+			if (gap > 0 && (value_step == 0 || gap < value_step)) value_step = gap;
+		}
+		uint8_t value_encoding = SEQ_UINT8;
+		uint32_t max_steps = 0;
+		for (float value : values) {
+			float steps = value_step > 0 ? std::round((value - value_min) / value_step) : 0;
+			if (!std::isfinite(value) || steps > 0xffff || dequantize(value_min, value_step, steps) != value) {
+				value_encoding = SEQ_FLOAT;
+				break;
+			}
+			max_steps = std::max(max_steps, (uint32_t)steps);
+		}
+		if (value_encoding != SEQ_FLOAT && max_steps > 0xff) value_encoding = SEQ_UINT16;
+
+		writer.put<int32_t>(event.time);
+		writer.put<int32_t>(event.duration);
+		writer.put<uint8_t>(event.interpolation);
+		writer.put<uint8_t>(time_encoding);
+		writer.put<uint8_t>(value_encoding);
+		writer.put<uint8_t>(event.generator ? SEQ_FLAG_GENERATOR : 0);
+		writer.put<uint32_t>(keys.size());
+		writer.put<float>(value_min);
+		writer.put<float>(value_step);
+		uint32_t last_frame = 0;
+		for (int i = 0; i < keys.size(); i++) {
+			if (time_encoding == SEQ_VARINT) {
+				writer.putVarint(frames[i] - last_frame);
+				last_frame = frames[i];
+			} else {
+				writer.put<float>(keys[i].first);
+			}
+		}
+		for (float value : values) {
+			uint32_t steps = value_step > 0 ? (uint32_t)std::round((value - value_min) / value_step) : 0;
+			if (value_encoding == SEQ_UINT8) writer.put<uint8_t>(steps);
+			else if (value_encoding == SEQ_UINT16) writer.put<uint16_t>(steps);
+			else writer.put<float>(value);
+		}
+		if (event.generator) {
+			const ScanGenerator& gen = *event.generator;
+			writer.put<uint8_t>(gen.output);
+			writer.put<uint8_t>(gen.is_x_major);
+			writer.put<int32_t>(gen.width);
+			writer.put<int32_t>(gen.height);
+			writer.put<int32_t>(gen.stride);
+			writer.put<int32_t>(gen.frames_per_step);
+			writer.put<int32_t>(gen.nsteps);
+			writer.put<float>(gen.stage_min);
+			writer.put<float>(gen.stage_max);
+		}
+	}
+
+	static void readEvent(SeqReader& reader, Event& event) {
+		event.time = reader.get<int32_t>();
+		event.duration = reader.get<int32_t>();
+		uint8_t interpolation = reader.get<uint8_t>();
+		uint8_t time_encoding = reader.get<uint8_t>();
+		uint8_t value_encoding = reader.get<uint8_t>();
+		uint8_t flags = reader.get<uint8_t>();
+		uint32_t n_keys = reader.get<uint32_t>();
+		float value_min = reader.get<float>();
+		float value_step = reader.get<float>();
+		if (interpolation >= INTERP_COUNT) throw std::runtime_error("Sequence file has an unknown interpolation");
+		// Every key takes a byte at least
+		if (n_keys > reader.remaining()) throw std::runtime_error("Sequence file is truncated");
+
+		event.interpolation = (Interpolation)interpolation;
+		event.keyframes.resize(n_keys);
+		uint32_t frame = 0;
+		for (auto& key : event.keyframes) {
+			if (time_encoding == SEQ_VARINT) {
+				frame += reader.getVarint();
+				key.first = (float)(int)frame / event.duration;
+			} else {
+				key.first = reader.get<float>();
+			}
+		}
+		for (auto& key : event.keyframes) {
+			if (value_encoding == SEQ_UINT8) key.second = dequantize(value_min, value_step, reader.get<uint8_t>());
+			else if (value_encoding == SEQ_UINT16) key.second = dequantize(value_min, value_step, reader.get<uint16_t>());
+			else key.second = reader.get<float>();
+		}
+		event.sort();
+		event.generator.reset();
+		if (flags & SEQ_FLAG_GENERATOR) {
+			ScanGenerator gen;
+			gen.output = (ScanGenerator::Output)reader.get<uint8_t>();
+			gen.is_x_major = reader.get<uint8_t>();
+			gen.width = reader.get<int32_t>();
+			gen.height = reader.get<int32_t>();
+			gen.stride = reader.get<int32_t>();
+			gen.frames_per_step = reader.get<int32_t>();
+			gen.nsteps = reader.get<int32_t>();
+			gen.stage_min = reader.get<float>();
+			gen.stage_max = reader.get<float>();
+			if (!gen.isValid()) throw std::runtime_error("Sequence file has a bad generator");
+			event.generator = gen;
+		}
+	}
+
+	void Sequencer::saveBinary(std::string path) {
+		std::cout << "Saving: " << path << std::endl;
+		SeqWriter writer;
+		SeqHeader header = {
+			.magic = VRAF_SEQ_MAGIC,
+			.version = VRAF_SEQ_VERSION,
+			.n_tracks = (uint32_t)tracks.size(),
+			.range_start = state.range[0],
+			.range_end = state.range[1],
+			.pan = state.pan.x,
+			.zoom = state.zoom.x,
+			.reserved = 0,
+			.index_offset = 0
+		};
+		writer.put(header);
+
+		std::vector<std::pair<uint64_t, uint64_t>> blocks;
+		for (Track& track : tracks) {
+			uint64_t offset = writer.data.size();
+			for (Event& event : track.events) writeEvent(writer, event);
+			blocks.push_back({ offset, writer.data.size() - offset });
+		}
+
+		header.index_offset = writer.data.size();
+		for (int i = 0; i < tracks.size(); i++) {
+			writer.put<uint32_t>(tracks[i].label.size());
+			writer.data.insert(writer.data.end(), tracks[i].label.begin(), tracks[i].label.end());
+			writer.put<uint32_t>(tracks[i].events.size());
+			writer.put<uint64_t>(blocks[i].first);
+			writer.put<uint64_t>(blocks[i].second);
+		}
+		memcpy(writer.data.data(), &header, sizeof(header));
+
+		std::ofstream fs(path, std::ios::binary);
+		fs.write((const char*)writer.data.data(), writer.data.size());
+	}
+
+	void Sequencer::loadBinary(std::string path) {
+		MappedFile file;
+		try {
+			file.open(path);
+			SeqReader reader(file.getData(), file.getSize());
+			SeqHeader header = reader.get<SeqHeader>();
+			if (header.magic != VRAF_SEQ_MAGIC || header.version < 1 || header.version > VRAF_SEQ_VERSION) {
+				std::cout << "File " << path << " has an unsupported version!" << std::endl;
+				return;
+			}
+
+			// Only the events of the tracked variables are decoded
+			reader.seek(header.index_offset);
+			for (uint32_t i = 0; i < header.n_tracks; i++) {
+				std::string label = reader.getString(reader.get<uint32_t>());
+				uint32_t n_events = reader.get<uint32_t>();
+				uint64_t offset = reader.get<uint64_t>();
+				uint64_t size = reader.get<uint64_t>();
+				TrackHandle handle = getTrack(label);
+				if (!handle.isValid()) {
+					std::cout << "Track with label " << label << " not found!" << std::endl;
+					continue;
+				}
+				Track& track = tracks[handle.index];
+				if (n_events != track.events.size()) {
+					std::cout << "Track with label " << label << " events size does not match!" << std::endl;
+					continue;
+				}
+				if (offset + size > file.getSize()) throw std::runtime_error("Sequence file is truncated");
+				SeqReader events(file.getData() + offset, size);
+				for (Event& event : track.events) readEvent(events, event);
+			}
+
+			state.range[0] = header.range_start;
+			state.range[1] = header.range_end;
+			state.pan.x = header.pan;
+			state.zoom.x = header.zoom;
+		} catch (const std::runtime_error& e) {
+			std::cout << "File " << path << " is not good: " << e.what() << std::endl;
+		}
+	}
+
 	void Sequencer::clear() {
 		for (Track &t : tracks) {
 			for (Event &e : t.events)
@@ -956,32 +1421,138 @@ namespace VRaF {
 	}
 
 	void Sequencer::addKeyframe(std::string label, float step, int nsteps, float value, int step_start) {
-		for (Track &t : tracks) {
-			if (t.label != label) continue;
-
-			t.events[0].time = step_start;
-			t.events[0].duration = nsteps;
-			t.events[0].keyframes.push_back({step, value});
-			state.range[0] = std::min((float)state.range[0], step_start + step * nsteps + 1);
-			state.range[1] = std::max((float)state.range[1], step_start + step * nsteps + 1);
-			// std::cout << "Adding key: " << step << ' ' << value << std::endl;
+		addKeyframe(getTrack(label), step, nsteps, value, step_start);
+	}
+
+	void Sequencer::addKeyframe(TrackHandle handle, float step, int nsteps, float value, int step_start) {
+		appendKeyframes(handle, nsteps, { { step, value } }, step_start);
+	}
+
+	void Sequencer::appendKeyframes(TrackHandle handle, int nsteps, const std::vector<std::pair<float, float>>& keys, int step_start) {
+		if (!handle.isValid() || keys.empty()) return;
+		Event &event = tracks[handle.index].events[0];
+
+		event.time = step_start;
+		event.duration = nsteps;
+		bool is_sorted = event.keyframes.empty() || keys[0].first >= event.keyframes.back().first;
+		float step_min = keys[0].first;
+		float step_max = keys[0].first;
+		for (int i = 0; i < keys.size(); i++) {
+			if (i > 0 && keys[i].first < keys[i - 1].first) is_sorted = false;
+			step_min = std::min(step_min, keys[i].first);
+			step_max = std::max(step_max, keys[i].first);
+		}
+		event.keyframes.insert(event.keyframes.end(), keys.begin(), keys.end());
+		event.revision++;
+		if (!is_sorted) event.sort();
+		state.range[0] = std::min((float)state.range[0], step_start + step_min * nsteps + 1);
+		state.range[1] = std::max((float)state.range[1], step_start + step_max * nsteps + 1);
+	}
+
+	void Sequencer::setInterpolation(std::string label, Interpolation interpolation) {
+		setInterpolation(getTrack(label), interpolation);
+	}
+
+	void Sequencer::setInterpolation(TrackHandle handle, Interpolation interpolation) {
+		if (!handle.isValid()) return;
+		for (Event &e : tracks[handle.index].events) e.interpolation = interpolation;
+	}
+
+	void Sequencer::setGenerator(TrackHandle handle, const ScanGenerator& generator, int step_start) {
+		if (!handle.isValid()) return;
+		Event &event = tracks[handle.index].events[0];
+		event.clear();
+		event.time = step_start;
+		event.duration = std::max(generator.duration(), 1);
+		event.generator = generator;
+		// Same range the keyframes of the generated values would take
+		state.range[0] = std::min(state.range[0], step_start + 1);
+		state.range[1] = std::max(state.range[1], step_start + event.duration);
+	}
+
+	void Sequencer::bake(TrackHandle handle) {
+		if (!handle.isValid()) return;
+		for (Event &e : tracks[handle.index].events) {
+			if (e.generator) e.generator->bake(e);
 		}
 	}
 
+	void Sequencer::bakeGenerators() {
+		for (int i = 0; i < tracks.size(); i++) bake({ i });
+	}
+
 	bool Event::update(int frame)
 	{
         bool result = false;
-		float frameNorm = (float)(frame - time) / duration;
-		float value = 0;
-		for (auto& [t, v] : keyframes) {
-			if (t <= frameNorm) value = v;
-		}
+		float value = valueAt(frame);
         if (*target != value) result = true;
 		*target = value;
 
         return result;
 	}
 
+	float Event::valueAt(int frame) const
+	{
+		if (generator) return generator->valueAt(frame - time);
+		float frameNorm = (float)(frame - time) / duration;
+		// Last keyframe at or before the frame
+		int i = findKeyframe(frameNorm);
+		if (i < 0) return 0;
+		if (interpolation == INTERP_STEP || i == keyframes.size() - 1) return keyframes[i].second;
+
+		auto [t1, v1] = keyframes[i];
+		auto [t2, v2] = keyframes[i + 1];
+		if (t2 <= t1) return v2;
+		float s = (frameNorm - t1) / (t2 - t1);
+		switch (interpolation) {
+		case INTERP_LINEAR:
+			return v1 + (v2 - v1) * s;
+		case INTERP_EASE:
+			return v1 + (v2 - v1) * s * s * (3 - 2 * s);
+		case INTERP_HERMITE: {
+			// Tangents from the neighbouring keys, scaled to this segment
+			float m1 = v2 - v1;
+			float m2 = v2 - v1;
+			if (i > 0 && t2 > keyframes[i - 1].first) {
+				m1 = (v2 - keyframes[i - 1].second) / (t2 - keyframes[i - 1].first) * (t2 - t1);
+			}
+			if (i + 2 < keyframes.size() && keyframes[i + 2].first > t1) {
+				m2 = (keyframes[i + 2].second - v1) / (keyframes[i + 2].first - t1) * (t2 - t1);
+			}
+			float s2 = s * s;
+			float s3 = s2 * s;
+			return (2 * s3 - 3 * s2 + 1) * v1 + (s3 - 2 * s2 + s) * m1 + (-2 * s3 + 3 * s2) * v2 + (s3 - s2) * m2;
+		}
+		default:
+			return v1;
+		}
+	}
+
+	int Event::findKeyframe(float frameNorm) const
+	{
+		int n = keyframes.size();
+		if (n == 0 || keyframes[0].first > frameNorm) return -1;
+		auto isAt = [&](int i) {
+			return i >= 0 && i < n && keyframes[i].first <= frameNorm && (i == n - 1 || keyframes[i + 1].first > frameNorm);
+		};
+		// Sequential playback stays at the cursor or moves to the next key
+		if (isAt(cursor)) return cursor;
+		if (isAt(cursor + 1)) return ++cursor;
+
+		auto it = std::upper_bound(keyframes.begin(), keyframes.end(), frameNorm,
+			[](float t, const std::pair<float, float>& key) { return t < key.first; });
+		cursor = it - keyframes.begin() - 1;
+		return cursor;
+	}
+
+	void Event::sort()
+	{
+		revision++;
+		std::stable_sort(keyframes.begin(), keyframes.end(),
+			[](const std::pair<float, float>& a, const std::pair<float, float>& b) { return a.first < b.first; });
+		cursor = 0;
+	}
+
 	void Event::filter(bool is_backwards)
 	{
 		// First-order Butterworth filter coefficients
@@ -993,6 +1564,7 @@ namespace VRaF {
 		float b[] = { 0.42080778, 0.42080778 };
 		float a[] = { 1., -0.15838444 };
 		if (is_backwards) std::reverse(keyframes.begin(), keyframes.end());
+		revision++;
 
 		float last_x = keyframes[0].second;
 		float last_y = last_x;
@@ -1012,15 +1584,278 @@ namespace VRaF {
 		filter(true);
 	}
 
+	void Event::decimate(float tolerance)
+	{
+		if (generator || keyframes.size() < 3) return;
+		std::vector<bool> is_kept(keyframes.size(), false);
+		is_kept.front() = true;
+		is_kept.back() = true;
+
+		if (interpolation == INTERP_STEP) {
+			// Only the changes matter
+			for (int i = 1; i < keyframes.size(); i++) {
+				if (keyframes[i].second != keyframes[i - 1].second) is_kept[i] = true;
+			}
+		} else if (interpolation == INTERP_LINEAR) {
+			// Ramer-Douglas-Peucker, by the value error of the linear interpolation
+			auto [vmin, vmax] = std::minmax_element(keyframes.begin(), keyframes.end(),
+				[](const std::pair<float, float>& a, const std::pair<float, float>& b) { return a.second < b.second; });
+			float max_error = tolerance * (vmax->second - vmin->second);
+			std::vector<std::pair<int, int>> segments = { { 0, (int)keyframes.size() - 1 } };
+			while (!segments.empty()) {
+				auto [first, last] = segments.back();
+				segments.pop_back();
+				auto [t1, v1] = keyframes[first];
+				auto [t2, v2] = keyframes[last];
+				int worst = -1;
+				float worst_error = max_error;
+				for (int i = first + 1; i < last; i++) {
+					float s = t2 > t1 ? (keyframes[i].first - t1) / (t2 - t1) : 0;
+					float error = std::abs(keyframes[i].second - (v1 + (v2 - v1) * s));
+					if (error > worst_error) {
+						worst = i;
+						worst_error = error;
+					}
+				}
+				if (worst < 0) continue;
+				is_kept[worst] = true;
+				segments.push_back({ first, worst });
+				segments.push_back({ worst, last });
+			}
+		} else {
+			// The curve passes through every key, removing any would change its shape
+			return;
+		}
+
+		int n = 0;
+		for (int i = 0; i < keyframes.size(); i++) {
+			if (is_kept[i]) keyframes[n++] = keyframes[i];
+		}
+		keyframes.resize(n);
+		cursor = 0;
+		revision++;
+	}
+
+	void KeyLod::build(const std::vector<std::pair<float, float>>& keyframes)
+	{
+		levels.resize(1);
+		levels[0].resize(keyframes.size());
+		for (int i = 0; i < keyframes.size(); i++) levels[0][i] = { keyframes[i].second, keyframes[i].second };
+		while (levels.back().size() > 1) {
+			const std::vector<std::pair<float, float>>& prev = levels.back();
+			std::vector<std::pair<float, float>> level((prev.size() + 1) / 2);
+			for (int i = 0; i < level.size(); i++) {
+				level[i] = prev[2 * i];
+				if (2 * i + 1 < prev.size()) {
+					level[i].first = std::min(level[i].first, prev[2 * i + 1].first);
+					level[i].second = std::max(level[i].second, prev[2 * i + 1].second);
+				}
+			}
+			levels.push_back(std::move(level));
+		}
+	}
+
+	std::pair<float, float> KeyLod::range(int first, int last) const
+	{
+		std::pair<float, float> result = { INFINITY, -INFINITY };
+		auto merge = [&](const std::pair<float, float>& block) {
+			result.first = std::min(result.first, block.first);
+			result.second = std::max(result.second, block.second);
+		};
+		for (int level = 0; first < last && level < levels.size(); level++) {
+			if (first & 1) merge(levels[level][first++]);
+			if (last & 1) merge(levels[level][--last]);
+			first >>= 1;
+			last >>= 1;
+		}
+		return result;
+	}
+
 	void Event::clear()
 	{
 		keyframes.clear();
 		time = 0;
 		duration = 0;
+		interpolation = INTERP_STEP;
+		cursor = 0;
+		generator.reset();
+		revision++;
+	}
+
+	bool ScanGenerator::isValid() const
+	{
+		return output >= SCAN_X && output <= SCAN_STAGE && nsteps > 0 && frames_per_step > 0
+			&& width > 0 && height > 0 && stride > 0;
+	}
+
+	float ScanGenerator::valueAt(int frame) const
+	{
+		if (!isValid()) return 0;
+		frame = std::max(0, std::min(frame, duration() - 1));
+		int step = frame / frames_per_step;
+		if (output == SCAN_STAGE) {
+			if (frames_per_step == 1) return stage_max;
+			float t = (float)(frame - step * frames_per_step) / (frames_per_step - 1);
+			return t * (stage_max - stage_min) + stage_min;
+		}
+
+		// The raster restarts with every channel, the last step of each may be short
+		int steps_per_channel = (width * height + stride - 1) / stride;
+		int cell = (step % steps_per_channel) * stride;
+		int x = is_x_major ? cell / height : cell % width;
+		int y = is_x_major ? cell % height : cell / width;
+		return output == SCAN_X ? x : y;
+	}
+
+	void ScanGenerator::bake(Event& event) const
+	{
+		// Position holds through a step, the stage is linear within it
+		event.generator.reset();
+		event.keyframes.clear();
+		event.cursor = 0;
+		event.revision++;
+		event.interpolation = output == SCAN_STAGE ? INTERP_LINEAR : INTERP_STEP;
+		event.keyframes.reserve(output == SCAN_STAGE ? nsteps * 2 : nsteps);
+		for (int step = 0; step < nsteps; step++) {
+			int frame = step * frames_per_step;
+			event.keyframes.push_back({ (float)frame / event.duration, valueAt(frame) });
+			if (output == SCAN_STAGE && frames_per_step > 1) {
+				frame += frames_per_step - 1;
+				event.keyframes.push_back({ (float)frame / event.duration, valueAt(frame) });
+			}
+		}
 	}
 	void Recording::update(int frame)
 	{
-		keyframes.push_back({ frame, *target });
+		keyframes->push(frame, *target);
+	}
+
+	// Writes full recording chunks to their storage's file and hands them back, one thread for all the recordings
+	class RecordingFlusher {
+	public:
+		static RecordingFlusher& get() {
+			static RecordingFlusher flusher;
+			return flusher;
+		}
+
+		~RecordingFlusher() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				is_stopping = true;
+			}
+			cv.notify_one();
+			thread.join();
+		}
+
+		void spill(RecordingStorage* storage, std::unique_ptr<RecordingChunk> chunk) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				queue.push_back({ storage, std::move(chunk) });
+			}
+			cv.notify_one();
+		}
+
+		// Until every queued chunk is written
+		void wait() {
+			std::unique_lock<std::mutex> lock(mutex);
+			done_cv.wait(lock, [this]() { return queue.empty() && !is_busy; });
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::condition_variable done_cv;
+		std::deque<std::pair<RecordingStorage*, std::unique_ptr<RecordingChunk>>> queue;
+		bool is_busy = false;
+		bool is_stopping = false;
+		// Last, so the thread starts with the rest in place
+		std::thread thread;
+
+		RecordingFlusher() : thread(&RecordingFlusher::run, this) {}
+
+		void run() {
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true) {
+				cv.wait(lock, [this]() { return !queue.empty() || is_stopping; });
+				if (queue.empty()) return;
+				auto [storage, chunk] = std::move(queue.front());
+				queue.pop_front();
+				is_busy = true;
+				lock.unlock();
+
+				if (std::fwrite(chunk->samples, sizeof(chunk->samples[0]), chunk->size, storage->spill) != chunk->size) {
+					std::cout << "Failed to write a recording chunk, " << chunk->size << " samples are lost" << std::endl;
+				}
+				chunk->size = 0;
+				{
+					std::lock_guard<std::mutex> spare_lock(storage->spare_mutex);
+					storage->spare.push_back(std::move(chunk));
+				}
+
+				lock.lock();
+				is_busy = false;
+				done_cv.notify_all();
+			}
+		}
+	};
+
+	RecordingStorage::RecordingStorage()
+	{
+		spill = std::tmpfile();
+		if (!spill) throw std::runtime_error("Can't create a file for the recording");
+		// Nothing is allocated while recording, unless the flusher falls behind
+		chunks.reserve(RECORDING_MEMORY_CHUNKS);
+		spare.reserve(RECORDING_MEMORY_CHUNKS);
+		chunks.push_back(std::make_unique<RecordingChunk>());
+		for (int i = 0; i < RECORDING_MEMORY_CHUNKS; i++) spare.push_back(std::make_unique<RecordingChunk>());
+		RecordingFlusher::get();
+	}
+
+	RecordingStorage::~RecordingStorage()
+	{
+		// The flusher may still be writing into the file
+		RecordingFlusher::get().wait();
+		std::fclose(spill);
+	}
+
+	void RecordingStorage::push(int frame, float value)
+	{
+		if (chunks.back()->size == RECORDING_CHUNK_SIZE) {
+			if (chunks.size() == RECORDING_MEMORY_CHUNKS) {
+				RecordingFlusher::get().spill(this, std::move(chunks.front()));
+				chunks.erase(chunks.begin());
+			}
+			std::unique_ptr<RecordingChunk> chunk;
+			{
+				std::lock_guard<std::mutex> lock(spare_mutex);
+				if (!spare.empty()) {
+					chunk = std::move(spare.back());
+					spare.pop_back();
+				}
+			}
+			chunks.push_back(chunk ? std::move(chunk) : std::make_unique<RecordingChunk>());
+		}
+		RecordingChunk& chunk = *chunks.back();
+		chunk.samples[chunk.size++] = { frame, value };
+		if (n_samples == 0) first_frame = frame;
+		last_frame = frame;
+		n_samples++;
+	}
+
+	void RecordingStorage::forEach(const std::function<void(int, float)>& callback)
+	{
+		RecordingFlusher::get().wait();
+		std::rewind(spill);
+		std::pair<int, float> samples[256];
+		size_t n;
+		while ((n = std::fread(samples, sizeof(samples[0]), 256, spill)) > 0) {
+			for (size_t i = 0; i < n; i++) callback(samples[i].first, samples[i].second);
+		}
+		// Back to the end, for the chunks to come
+		std::fseek(spill, 0, SEEK_END);
+		for (const std::unique_ptr<RecordingChunk>& chunk : chunks) {
+			for (int i = 0; i < chunk->size; i++) callback(chunk->samples[i].first, chunk->samples[i].second);
+		}
 	}
 
 	SeqIterator Sequencer::begin() {
@@ -1053,4 +1888,53 @@ namespace VRaF {
 		++(*this);
 		return result;
 	}
+
+	void benchmarkEvents(int nkeys)
+	{
+		float value = 0;
+		Event event = { 0, nkeys, {}, &value, INTERP_LINEAR };
+		event.keyframes.reserve(nkeys);
+		for (int i = 0; i < nkeys; i++) event.keyframes.push_back({ (float)i / nkeys, (float)(rand() % 1000) });
+		event.sort();
+
+		using clock = std::chrono::high_resolution_clock;
+		auto report = [](const char* name, clock::duration elapsed, int nlookups, float checksum) {
+			double ns = std::chrono::duration<double, std::nano>(elapsed).count() / nlookups;
+			std::cout << name << ": " << ns << " ns per frame (checksum " << checksum << ")" << std::endl;
+		};
+
+		// Playback, every frame in order
+		float checksum = 0;
+		auto start = clock::now();
+		for (int frame = 0; frame <= event.duration; frame++) {
+			event.update(frame);
+			checksum += value;
+		}
+		report("Sequential", clock::now() - start, event.duration + 1, checksum);
+
+		// Scrubbing, frames in random order
+		std::vector<int> frames(nkeys);
+		for (int& frame : frames) frame = rand() % (event.duration + 1);
+		checksum = 0;
+		start = clock::now();
+		for (int frame : frames) {
+			event.update(frame);
+			checksum += value;
+		}
+		report("Random", clock::now() - start, frames.size(), checksum);
+
+		// The full scan every lookup used to be; too slow to run over all the frames
+		int nscans = std::min(nkeys, 1000);
+		checksum = 0;
+		start = clock::now();
+		for (int i = 0; i < nscans; i++) {
+			float frameNorm = (float)frames[i] / event.duration;
+			float scanned = 0;
+			for (auto& [t, v] : event.keyframes) {
+				if (t <= frameNorm) scanned = v;
+			}
+			checksum += scanned;
+		}
+		report("Linear scan", clock::now() - start, nscans, checksum);
+	}
 }
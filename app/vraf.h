@@ -3,7 +3,12 @@
 
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <optional>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <cstdio>
 #include "nvmath/nvmath.h"
 #include "../imgui/imgui.h"
 #include "json.hpp"
@@ -12,21 +17,138 @@ using vec2 = nvmath::vec2f;
 using vec3 = nvmath::vec3f;
 using vec4 = nvmath::vec4f;
 
+// Binary sequence files
+#define VRAF_SEQ_MAGIC 0x51535256		// "VRSQ"
+#define VRAF_SEQ_VERSION 2
+
+// Largest change decimation may make to a value, relative to the value range of the event
+#define DECIMATE_TOLERANCE 0.001f
+
+// Recorded samples are stored in chunks of this many
+#define RECORDING_CHUNK_SIZE 2048
+// Chunks a recording keeps in memory; older ones are moved to a temporary file in the background
+#define RECORDING_MEMORY_CHUNKS 4
+
 // Vector Recording and Filtering namespace
 namespace VRaF {
 	class Sequencer;
 
+	// How an event's value changes between two keyframes
+	enum Interpolation {
+		INTERP_STEP,		// Holds the value of the last keyframe
+		INTERP_LINEAR,
+		INTERP_HERMITE,		// Cubic, with Catmull-Rom tangents
+		INTERP_EASE,		// Smoothstep; eases in and out of every keyframe
+
+		INTERP_COUNT
+	};
+
+	// How the playback advances the frames
+	enum PlaybackClock {
+		PLAYBACK_FIXED_STEP,	// A frame per update, never ahead of the wall clock; slows down instead of skipping
+		PLAYBACK_REALTIME,		// Follows the wall clock, jumping over the frames it's behind by
+		PLAYBACK_FREE_RUN,		// A frame per update, as fast as they come
+
+		PLAYBACK_COUNT
+	};
+	extern const char* clock_names[PLAYBACK_COUNT];
+
+	struct Event;
+
+	// Raster scan over a grid, a cell per step, with a stage going from min to max within every step.
+	// The scan starts over every ceil(width * height / stride) steps, once per channel.
+	// Computed from the frame instead of stored as keyframes
+	struct ScanGenerator {
+		enum Output : int {
+			SCAN_X,
+			SCAN_Y,
+			SCAN_STAGE
+		};
+		Output output;
+		int width, height;
+		int stride = 1;				// Cells advanced per step
+		bool is_x_major = true;		// Y changes every step, X once per column
+		int frames_per_step;
+		int nsteps;
+		float stage_min, stage_max;
+
+		int duration() const { return nsteps * frames_per_step; }
+		// Known output and positive sizes; loaded generators are checked with it
+		bool isValid() const;
+		float valueAt(int frame) const;		// Frame from the start of the event
+		// Writes the keys that give the same values into the event
+		void bake(Event& event) const;
+	};
+
+	// Min/max pyramid over keyframe values, for drawing keys denser than a pixel
+	struct KeyLod {
+		int revision = -1;		// Event revision it was built for
+		std::vector<std::vector<std::pair<float, float>>> levels;	// Min & max; every level halves the previous one
+		void build(const std::vector<std::pair<float, float>>& keyframes);
+		// Min & max of the values of keys [first, last)
+		std::pair<float, float> range(int first, int last) const;
+	};
+
 	struct Event {
 		mutable int time;  // Start time, to be precise
 		mutable int duration;
 		// pair<float, float> is Time, Value
-		// In keyframes, time is a float from 0 to 1; in order to ease scaling
+		// In keyframes, time is a float from 0 to 1; in order to ease scaling.
+		// Kept sorted by time
 		std::vector<std::pair<float, float>> keyframes;
 		bool update(int frame);
+		float valueAt(int frame) const;
+		// Index of the last keyframe at or before the time, -1 if there is none
+		int findKeyframe(float frameNorm) const;
+		void sort();
 		void filter(bool is_backwards);
 		void filter();
+		// Drops the keyframes that can be interpolated from their neighbours within the tolerance
+		void decimate(float tolerance = DECIMATE_TOLERANCE);
 		void clear();
 		float* target = 0;
+		Interpolation interpolation = INTERP_STEP;
+		// Keyframe found by the last lookup; playback moves it by a key at most
+		mutable int cursor = 0;
+		// If set, the values come from it and the keyframes are unused
+		std::optional<ScanGenerator> generator;
+		// Bumped whenever the keyframes change
+		int revision = 0;
+		mutable KeyLod lod;
+	};
+
+	// Times keyframe lookups over a synthetic event, prints the results
+	void benchmarkEvents(int nkeys);
+
+	struct RecordingChunk {
+		std::pair<int, float> samples[RECORDING_CHUNK_SIZE];
+		int size = 0;
+	};
+
+	class RecordingFlusher;
+
+	// Append-only storage for the samples of a recording. The chunks are allocated up front;
+	// once RECORDING_MEMORY_CHUNKS are full, the oldest is written out in the background and comes back empty
+	class RecordingStorage {
+	public:
+		RecordingStorage();
+		~RecordingStorage();
+		void push(int frame, float value);
+		bool empty() const { return n_samples == 0; }
+		int firstFrame() const { return first_frame; }
+		int lastFrame() const { return last_frame; }
+		// Every sample in order, the ones written out included
+		void forEach(const std::function<void(int, float)>& callback);
+
+	private:
+		friend class RecordingFlusher;
+		std::vector<std::unique_ptr<RecordingChunk>> chunks;	// In memory, oldest first; the last one is being filled
+		std::vector<std::unique_ptr<RecordingChunk>> spare;		// Returned by the flusher
+		std::mutex spare_mutex;
+		std::FILE* spill;		// Written by the flusher only
+		size_t n_samples = 0;
+		int first_frame = 0;
+		int last_frame = 0;
 	};
 
 	struct Recording {
@@ -34,7 +156,7 @@ namespace VRaF {
 		// As contrary to Event keyframes, this array holds
 		// frame index as the key, thus the key is of type int
 		// pair<int, float> is Frame, Value
-		std::vector<std::pair<int, float>> keyframes;
+		std::unique_ptr<RecordingStorage> keyframes = std::make_unique<RecordingStorage>();
 		void update(int frame);
 	};
 
@@ -47,8 +169,16 @@ namespace VRaF {
 		bool is_expanded = true;
 	};
 
+	// Refers to a track by its position, so it stays valid as more tracks are added
+	struct TrackHandle {
+		int index = -1;
+		bool isValid() const { return index >= 0; }
+	};
+
 	struct SeqState {
 		bool isPlaying;
+		PlaybackClock clock;
+		int droppedFrames;	// Skipped by the real-time clock since the playback started
 		float startTime;
 		float currTime;
 		int frame;
@@ -98,6 +228,14 @@ namespace VRaF {
 		void toggle();
 		void draw();
 		void update(float time);
+		int getFrame();
+		int getFps() const { return fps; }
+		void setClock(PlaybackClock clock);
+		PlaybackClock getClock() const { return state.clock; }
+		int getDroppedFrames() const { return state.droppedFrames; }
+		// Value the track will have at the frame, without applying it. False if no event covers the frame
+		bool peek(std::string label, int frame, float &value);
+		bool peek(TrackHandle handle, int frame, float &value);
 		SeqIterator begin();
 		SeqIterator end();
 
@@ -106,33 +244,52 @@ namespace VRaF {
 		void record(float* target);
 		void clear();
 		void addKeyframe(std::string label, float step, int nsteps, float value, int step_start=0);
-		void track(std::string label, float* value);
-		void track(std::string label, vec2* value);
-		void track(std::string label, vec3* value);
-		void track(std::string label, vec4* value);
-		void track(std::string label, float* value, std::function<void()> callback);
-		void track(std::string label, vec2* value, std::function<void()> callback);
-		void track(std::string label, vec3* value, std::function<void()> callback);
-		void track(std::string label, vec4* value, std::function<void()> callback);
+		void addKeyframe(TrackHandle handle, float step, int nsteps, float value, int step_start=0);
+		// Same as addKeyframe for every key; keys are pairs of step and value
+		void appendKeyframes(TrackHandle handle, int nsteps, const std::vector<std::pair<float, float>>& keys, int step_start=0);
+		void setInterpolation(std::string label, Interpolation interpolation);
+		void setInterpolation(TrackHandle handle, Interpolation interpolation);
+		void setGenerator(TrackHandle handle, const ScanGenerator& generator, int step_start=0);
+		// Turns the generated values into keyframes, so they can be edited
+		void bake(TrackHandle handle);
+		void bakeGenerators();
+		// Invalid handle if there is no such track
+		TrackHandle getTrack(const std::string& label) const;
+		TrackHandle track(std::string label, float* value);
+		TrackHandle track(std::string label, vec2* value);
+		TrackHandle track(std::string label, vec3* value);
+		TrackHandle track(std::string label, vec4* value);
+		TrackHandle track(std::string label, float* value, std::function<void()> callback);
+		TrackHandle track(std::string label, vec2* value, std::function<void()> callback);
+		TrackHandle track(std::string label, vec3* value, std::function<void()> callback);
+		TrackHandle track(std::string label, vec4* value, std::function<void()> callback);
         void onFrameUpdated(std::function<void(int)> callback);
 
+		// Binary files are told by their magic, anything else is read as JSON
 		void loadFile(std::string path);
+		// Files ending with .vseq are binary, anything else is JSON
 		void saveFile(std::string path);
+		void loadBinary(std::string path);
+		void saveBinary(std::string path);
 
 	private:
 		SeqState state;
 		std::vector<Track> tracks;
+		std::unordered_map<std::string, int> track_index;	// Label to the index in tracks
 		int fps;
         std::function<void(int)> callback;
 
 		Dimentions dims;
 		void stop_recording();
+		TrackHandle addTrack(Track track);
 		void drawBackground(SectionType section);
 		void drawTracks(SectionType section);
 		void drawGrid(SectionType section);
 		void drawIndicators();
 		void updateEvents();
 		void updateEvents(int frame);
+		// Makes the frame current and evaluates it, the same way the offline iteration does
+		void stepTo(int frame);
 		ImFont* icons;
 		ImFont* labels;
 	};